@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""End-to-end benchmarks: drive the shell binary over a pty (make bench).
+
+Measures startup-to-prompt latency, interactive commands per second
+(external and builtin) and pipeline throughput. Results are printed as
+one JSON object per line, like bench/micro:
+
+    {"suite":"e2e","bench":"commands_per_sec/external","runs":500,"value":812.4,"unit":"cmd/s"}
+
+Usage: bench/e2e.py [path/to/shell]   (default ./shell)
+BENCH_E2E_RUNS scales the number of repetitions (default 1.0).
+"""
+import json
+import os
+import pty
+import select
+import signal
+import statistics
+import sys
+import time
+
+PROMPT = b"$ "
+SCALE = float(os.environ.get("BENCH_E2E_RUNS", "1.0"))
+
+
+class Session:
+    """One interactive shell on a pty."""
+
+    def __init__(self, shell):
+        env = dict(os.environ, TERM="dumb", INPUTRC="/dev/null")
+        env.pop("HISTFILE", None)
+        env.pop("SHELL_METRICS_LOG", None)
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.execve(shell, [shell], env)
+        self.pending = b""
+
+    def wait_prompt(self, timeout=30.0):
+        """Reads until the output ends in a prompt; returns the output."""
+        deadline = time.monotonic() + timeout
+        while not self.pending.endswith(PROMPT):
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError("no prompt; got %r" % self.pending[-200:])
+            ready, _, _ = select.select([self.fd], [], [], left)
+            if ready:
+                chunk = os.read(self.fd, 65536)
+                if not chunk:
+                    raise EOFError("shell exited")
+                self.pending += chunk
+        out, self.pending = self.pending, b""
+        return out
+
+    def run(self, line):
+        os.write(self.fd, line.encode() + b"\n")
+        return self.wait_prompt()
+
+    def close(self):
+        try:
+            os.write(self.fd, b"exit\n")
+        except OSError:
+            pass
+        deadline = time.monotonic() + 5
+        while time.monotonic() < deadline:
+            if os.waitpid(self.pid, os.WNOHANG)[0]:
+                break
+            time.sleep(0.01)
+        else:
+            os.kill(self.pid, signal.SIGKILL)
+            os.waitpid(self.pid, 0)
+        os.close(self.fd)
+
+
+def emit(bench, runs, value, unit, **extra):
+    record = {"suite": "e2e", "bench": bench, "runs": runs, "value": round(value, 3), "unit": unit}
+    record.update(extra)
+    print(json.dumps(record, separators=(",", ":")), flush=True)
+
+
+def runs(n):
+    return max(1, int(n * SCALE))
+
+
+def bench_startup(shell):
+    samples = []
+    for _ in range(runs(20)):
+        start = time.monotonic()
+        session = Session(shell)
+        session.wait_prompt()
+        samples.append((time.monotonic() - start) * 1000)
+        session.close()
+    samples.sort()
+    emit("startup_to_prompt", len(samples), statistics.median(samples), "ms",
+         p90=round(samples[min(len(samples) - 1, int(len(samples) * 0.9))], 3))
+
+
+def bench_commands(shell, name, line, n):
+    session = Session(shell)
+    session.wait_prompt()
+    n = runs(n)
+    start = time.monotonic()
+    for _ in range(n):
+        session.run(line)
+    elapsed = time.monotonic() - start
+    session.close()
+    emit("commands_per_sec/" + name, n, n / elapsed, "cmd/s")
+
+
+def bench_pipeline(shell, name, line, megabytes):
+    session = Session(shell)
+    session.wait_prompt()
+    n = runs(3)
+    samples = []
+    for _ in range(n):
+        start = time.monotonic()
+        session.run(line)
+        samples.append(time.monotonic() - start)
+    session.close()
+    emit("pipeline_throughput/" + name, n, megabytes / min(samples), "MB/s")
+
+
+def main():
+    shell = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./shell")
+    bench_startup(shell)
+    bench_commands(shell, "external", "true", 500)
+    bench_commands(shell, "builtin", "echo x", 2000)
+    bench_commands(shell, "pipeline", "echo x | cat", 300)
+    bench_pipeline(shell, "cat_x2", "head -c 268435456 /dev/zero | cat | cat > /dev/null", 256)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,141 @@
+// ------------------------------------------------------------
+// Microbenchmarks for the shell's hot paths (make bench)
+// ------------------------------------------------------------
+/* The shell is a single translation unit, so it is included here with
+   its main() renamed; every helper is then callable directly. Results
+   are printed as one JSON object per line:
+
+       {"suite":"micro","bench":"parse_line/pipeline","iterations":N,"ns_per_op":X}
+
+   BENCH_MIN_TIME (seconds, default 0.2) sets how long each benchmark
+   runs; BENCH_PATH_DIRS / BENCH_PATH_EXECS size the synthetic PATH used
+   by the lookup and completion benchmarks (default 40 x 125). */
+#define main shell_main
+#include "../shell.cpp"
+#undef main
+
+// Helper: Keeps the compiler from discarding a benchmarked result
+template<class T>
+void keep(const T& value){
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static double min_time = 0.2;
+
+// Helper: Runs f in growing batches until one batch takes min_time, then reports that batch
+template<class F>
+void bench(const string& name, F f){
+    for(size_t iters = 1; ; iters *= 2){
+        Clock::time_point start = Clock::now();
+        for(size_t i=0; i<iters; i++) f();
+        double elapsed = seconds_since(start);
+        if(elapsed >= min_time || iters >= (size_t(1) << 40)){
+            printf("{\"suite\":\"micro\",\"bench\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.1f}\n",
+                   name.c_str(), iters, elapsed*1e9/iters);
+            fflush(stdout);
+            return;
+        }
+    }
+}
+
+// Helper: Name of the serial-th synthetic executable
+static const char* const name_prefixes[] = {"git-", "gcc-", "kube", "python3.", "x"};
+
+string synthetic_name(int serial){
+    return string(name_prefixes[serial%5])+to_string(serial);
+}
+
+/* Helper:
+		Creates dirs x execs empty executables spread over a temporary
+		PATH. Names share a handful of prefixes (git-, gcc-, kube, ...)
+		so completion sees both wide and narrow match sets. */
+string make_synthetic_path(const string& root, int dirs, int execs){
+    string path_env;
+    int serial = 0;
+    for(int d=0; d<dirs; d++){
+        string dir = root+"/bin"+to_string(d);
+        mkdir(dir.c_str(), 0755);
+        for(int e=0; e<execs; e++, serial++){
+            int fd = open((dir+"/"+synthetic_name(serial)).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+            if(fd >= 0) close(fd);
+        }
+        if(!path_env.empty()) path_env += ":";
+        path_env += dir;
+    }
+    return path_env;
+}
+
+int main(){
+    register_builtins();
+    import_environment();
+    if(const string* env = get_var("BENCH_MIN_TIME")) min_time = atof(env->c_str());
+    int dirs = env_number("BENCH_PATH_DIRS", 40);
+    int execs = env_number("BENCH_PATH_EXECS", 125);
+
+    // ---------- lexer / parser ----------
+    const string simple = "ls -la /tmp";
+    const string quoted = "echo \"hello world\" 'single quoted' escaped\\ space \"a\\\"b\"";
+    const string pipeline = "cat file.txt | grep -v '^#' | sort -u > out.txt 2>> err.log";
+    string long_line = "printf";
+    for(int i=0; i<64; i++) long_line += " arg"+to_string(i);
+
+    vector<Token> tokens;
+    vector<char> buf;
+    auto lex = [&](const string& line){
+        return [&tokens, &buf, &line](){
+            buf.assign(line.begin(), line.end());
+            buf.push_back('\0');
+            tokens.clear();
+            lex_line(buf.data(), line.size(), tokens);
+            keep(tokens.size());
+        };
+    };
+    bench("lex_line/simple", lex(simple));
+    bench("lex_line/quoted", lex(quoted));
+    bench("lex_line/pipeline", lex(pipeline));
+    bench("parse_line/simple", [&](){ keep(parse_line(simple).lists[0].items.size()); });
+    bench("parse_line/pipeline", [&](){ keep(parse_line(pipeline).lists[0].items.size()); });
+    bench("parse_line/64_args", [&](){ keep(parse_line(long_line).lists[0].items.size()); });
+    bench("parse_cached/pipeline", [&](){ keep(parse_cached(pipeline)->lists[0].items.size()); });
+
+    // ---------- longest common prefix ----------
+    vector<string> names;
+    for(int i=0; i<1000; i++) names.push_back("git-subcommand-"+to_string(i));
+    bench("longest_common_prefix/1000", [&](){ keep(longest_common_prefix(names).size()); });
+
+    // ---------- PATH lookup over a synthetic PATH ----------
+    char root_template[] = "/tmp/shell-bench-XXXXXX";
+    if(!mkdtemp(root_template)){
+        perror("mkdtemp");
+        return 1;
+    }
+    string root = root_template;
+    string path_env = make_synthetic_path(root, dirs, execs);
+    variables.set("PATH", path_env, true);
+    int total = dirs*execs;
+    string last = synthetic_name(total-1);		// only in the last PATH directory
+
+    bench("search_path/last_dir", [&](){ keep(search_path(last).size()); });
+    bench("search_path/miss", [&](){ keep(search_path("no-such-command").size()); });
+    bench("find_command/hashed", [&](){ keep(find_command(last).size()); });
+
+    // ---------- completion over the synthetic PATH ----------
+    string tag = "/"+to_string(total);
+    bench("build_exec_index"+tag, [&](){
+        build_exec_index(path_env);
+        keep(exec_index.size());
+    });
+    auto complete = [&](const string& prefix){
+        return [prefix](){
+            refresh_exec_index();
+            vector<string> matches = exec_index_lookup(prefix);
+            keep(longest_common_prefix(matches).size());
+        };
+    };
+    bench("complete/wide"+tag, complete("git-"));			// a fifth of all names
+    bench("complete/narrow"+tag, complete("git-12"));
+    bench("complete/none"+tag, complete("zzz"));
+
+    filesystem::remove_all(root);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/* ------------------------------------------------------------
+   basename NAME [SUFFIX], as a loadable builtin
+   ------------------------------------------------------------
+   make builtins, then in the shell:
+
+       enable -f builtins/basename.so basename
+
+   Options (-a, -s, -z, --help) are declined and run /usr/bin/basename. */
+#include <string.h>
+#include <unistd.h>
+
+#include "shell_builtin.h"
+
+static int basename_accepts(int argc, char* const argv[]){
+    if(argc < 2 || argc > 3) return SHELL_BUILTIN_DECLINE;
+    if(argv[1][0] == '-') return SHELL_BUILTIN_DECLINE;
+    return SHELL_BUILTIN_ACCEPT;
+}
+
+static int basename_run(int argc, char* const argv[], int in_fd, int out_fd, int err_fd){
+    (void)in_fd;
+    (void)err_fd;
+    const char* name = argv[1];
+    size_t len = strlen(name);
+
+    // Trailing slashes don't count; a name of only slashes is "/"
+    while(len > 1 && name[len-1] == '/') len--;
+    size_t start = len;
+    while(start > 0 && name[start-1] != '/') start--;
+    if(len == 1 && name[0] == '/') start = 0;
+
+    // The suffix is removed unless it is the whole name
+    if(argc == 3){
+        size_t suffix = strlen(argv[2]);
+        if(suffix < len-start && memcmp(name+len-suffix, argv[2], suffix) == 0) len -= suffix;
+    }
+
+    char line[4096];
+    size_t n = len-start;
+    if(n > sizeof(line)-1) n = sizeof(line)-1;
+    memcpy(line, name+start, n);
+    line[n++] = '\n';
+    return write(out_fd, line, n) == (ssize_t)n ? 0 : 1;
+}
+
+struct shell_builtin basename_builtin = {
+    SHELL_BUILTIN_ABI_VERSION, "basename", basename_accepts, basename_run
+};
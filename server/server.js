@@ -30,6 +30,16 @@ app.use(express.static(path.join(__dirname, "public")));
 const SHELL_PATH = path.join(__dirname, "..", "shell");
 console.log("SHELL_PATH:", SHELL_PATH); 
 
+// optional warm session pool (shell --pool SOCKET) or multiplexer
+// (shell --multiplex SOCKET); sessions attach to it
+const SHELL_POOL_SOCKET = process.env.SHELL_POOL_SOCKET;
+const SHELL_ARGS = SHELL_POOL_SOCKET ? ["--attach", SHELL_POOL_SOCKET] : [];
+
+// optional session recordings: one file per session in this directory
+// (replay with shell --cast FILE)
+const SHELL_RECORD_DIR = process.env.SHELL_RECORD_DIR;
+if (SHELL_RECORD_DIR) fs.mkdirSync(SHELL_RECORD_DIR, { recursive: true });
+
 wss.on("connection", (ws, req) => {
   	const url = new URL(req.url, `http://${req.headers.host}`);
 	const key = url.searchParams.get("key");
@@ -49,9 +59,12 @@ wss.on("connection", (ws, req) => {
   fs.mkdirSync(sessionDir);
 
   // spawn custom shell
-  const shellProcess = pty.spawn(SHELL_PATH, [], {
+  const env = SHELL_RECORD_DIR
+    ? { ...process.env, SHELL_RECORD: path.join(SHELL_RECORD_DIR, `${path.basename(sessionDir)}.rec`) }
+    : process.env;
+  const shellProcess = pty.spawn(SHELL_PATH, SHELL_ARGS, {
     cwd: sessionDir,
-    env: process.env
+    env
   });
 
   shellProcess.on("data", data => ws.send(data));
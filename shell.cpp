@@ -10,15 +10,81 @@
 #include <fcntl.h>
 #include <algorithm>
 #include <fstream>
+#include <unordered_map>
+#include <array>
+#include <map>
+#include <list>
+#include <deque>
+#include <termios.h>
+#include <unordered_set>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <string_view>
+#include <climits>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <atomic>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <spawn.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#endif
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+// rl_message() is only prototyped as variadic with these defined
+#define USE_VARARGS
+#define PREFER_STDARG
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <dlfcn.h>
+#include <zlib.h>
+#include "shell_builtin.h"
 using namespace std;
 
 static int last_history_written = 0;
 
+/* Builtin registry: command name -> handler, filled in by
+   register_builtins(). Shell builtins write to the command's output
+   streams and may act on the shell; utilities are in-process versions
+   of external commands (bundled, or loaded with enable -f) behind the
+   C ABI of shell_builtin.h, which can decline an invocation. */
+using BuiltinHandler = int (*)(const vector<string_view>& tokens, ostream& out, ostream& err);
+
+struct Builtin {
+    BuiltinHandler run = nullptr;			// shell builtin
+    const shell_builtin* utility = nullptr;	// in-process utility
+    bool changes_shell = false;				// acts on the shell itself (cd, exit, ...): never in a child
+    bool enabled = true;					// enable -n NAME turns it off
+};
+static unordered_map<string_view, Builtin> builtin_table;
+
+// Helper: The enabled builtin or utility named token, if any
+const Builtin* find_builtin(string_view token){
+    auto it = builtin_table.find(token);
+    return it != builtin_table.end() && it->second.enabled ? &it->second : nullptr;
+}
+
 // Helper: Checks whether a command is a shell built-in
-bool is_builtin(string &token){
-  	return (token=="echo" || token=="exit" || token=="type" || token=="pwd" || token=="cd" || token=="history");
+bool is_builtin(string_view token){
+    const Builtin* builtin = find_builtin(token);
+    return builtin && builtin->run;
 }
 
 // Helper: Splits PATH environment variable into individual directories
@@ -36,708 +102,6545 @@ vector<string> split_path(const string &path){
   	return dirs;
 }
 
-/* Helper:
-		Parses user input into tokens
-		Handles:
-		- Single quotes
-		- Double quotes
-		- Backslash escaping inside and outside quotes */
-vector<string> parse_input(const string& input){
-  	vector<string> tokens;
-  	string current;
-  	bool in_single_quotes = false;
-  	bool in_double_quotes = false;
-  	for(size_t i=0; i<input.size(); i++){
-  	  	char c=input[i];
-  	  	if(in_single_quotes){
-  	    	if(c=='\'')
-  	    		in_single_quotes=false;
-  	    	else current+=c;
-  	  	}
-  	  	else if(in_double_quotes){
-  	    	if(c=='"'){
-  	      		in_double_quotes=false;
-  	    	}
-  	    else if(c=='\\' && i+1<input.size() && (input[i+1]=='"' || input[i+1]=='\\' || input[i+1]=='$' || input[i+1]=='`')){
-  	      	current+=input[++i];
-  	    }
-  	    else current+=c;
-  	  	}
-  	  	else{
-  	    	if(c=='\''){
-  	      		in_single_quotes=true;
-  	    	}
-  	    	else if(c=='"'){
-  	      	in_double_quotes=true;
-  	    	}
-  	    	else if(c=='\\' && i+1<input.size()){
-  	      		current+=input[++i];
-  	    	}
-  	    	else if(isspace(c)){
-  	      		if(!current.empty()){
-  	        		tokens.push_back(current);
-  	        		current.clear();
-  	      		}
-  	    	}
-  	    	else current+=c;
-  	  	}
-  	}
-  	if(!current.empty()) tokens.push_back(current);
-  	return tokens;
+// Helper: Convert parsed words -> char*[] (words are NUL-terminated in their arena)
+vector<char*> make_argv(const vector<string_view>& args) {
+    vector<char*> argv;
+    argv.reserve(args.size()+1);
+    for(auto s : args) argv.push_back(const_cast<char*>(s.data()));
+    argv.push_back(nullptr);
+    return argv;
 }
 
-// Helper: Builtin commands allowed for completion
-vector<string> builtins = {"echo", "exit", "history"};
-
-// Helper: Longest Common Prefix
-string longest_common_prefix(const vector<string>& strs){
-    if (strs.empty()) return "";
-
-    string prefix = strs[0];
-    for(size_t i=1; i<strs.size(); i++){
-        size_t j = 0;
-        while(j<prefix.size() && j<strs[i].size() && prefix[j]==strs[i][j]){
-            j++;
+// Helper: Appends text to out as the inside of a JSON string
+void json_escape(string_view text, string& out){
+    char num[8];
+    for(unsigned char c : text){
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
         }
-        prefix = prefix.substr(0, j);
-        if(prefix.empty()) break;
+        else if(c < 0x20){
+            snprintf(num, sizeof num, "\\u%04x", c);
+            out += num;
+        }
+        else out += c;
     }
-    return prefix;
 }
 
-// Helper: Convert vector<string> -> char*[]
-vector<char*> make_argv(vector<string>& args) {
-    vector<char*> argv;
-    for(auto& s : args) argv.push_back(&s[0]);
-    argv.push_back(nullptr);
-    return argv;
+// ------------------------------------------------------------
+// Tracing (make TRACE=1)
+// ------------------------------------------------------------
+/* TRACE_SPAN("phase", detail) times the rest of the enclosing block.
+   Without SHELL_TRACE the macro expands to nothing; compiled in, a
+   span costs one flag test until tracing is switched on (SHELL_TRACE
+   in the environment or `set -o trace`). Finished spans go into a
+   fixed ring buffer that threads claim slots in with one atomic
+   increment; each slot carries a sequence number so a dump skips
+   slots being rewritten. `trace FILE` writes the buffer as Chrome
+   trace-event JSON (chrome://tracing, ui.perfetto.dev). */
+#ifdef SHELL_TRACE
+static atomic<bool> trace_enabled{false};	// checked by every span, worker threads' too
+static string trace_file;				// SHELL_TRACE: written when the shell exits
+static pid_t trace_owner = 0;			// forked children don't write it
+
+struct TraceEvent {
+    atomic<uint64_t> seq{0};			// index+1 once the slot is completely written
+    const char* name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint32_t tid;
+    char detail[44];
+};
+const size_t TRACE_CAPACITY = 1 << 16;	// newest events kept; older ones are overwritten
+static TraceEvent trace_ring[TRACE_CAPACITY];
+static atomic<uint64_t> trace_next{0};
+static atomic<uint64_t> trace_first{0};	// trace -c: events before this are discarded
+
+// Helper: Monotonic time in nanoseconds
+uint64_t trace_now(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Helper: Kernel thread id of the caller (cached per thread)
+uint32_t trace_tid(){
+#ifdef __linux__
+    static thread_local uint32_t tid = syscall(SYS_gettid);
+#else
+    static thread_local uint32_t tid = hash<thread::id>()(this_thread::get_id());
+#endif
+    return tid;
+}
+
+// Helper: Stores one finished span in the ring buffer
+void trace_record(const char* name, string_view detail, uint64_t start, uint64_t end){
+    uint64_t i = trace_next.fetch_add(1, memory_order_relaxed);
+    TraceEvent& e = trace_ring[i & (TRACE_CAPACITY-1)];
+    e.seq.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e.name = name;
+    e.start_ns = start;
+    e.dur_ns = end-start;
+    e.tid = trace_tid();
+    size_t n = min(detail.size(), sizeof(e.detail)-1);
+    memcpy(e.detail, detail.data(), n);
+    e.detail[n] = '\0';
+    e.seq.store(i+1, memory_order_release);
 }
 
-// Helper: Split pipeline stages
-vector<vector<string>> split_pipeline(const vector<string>& tokens){
-    vector<vector<string>> stages;
-    vector<string> current;
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* span_name, string_view span_detail = {}){
+        if(!trace_enabled.load(memory_order_relaxed)) return;
+        name = span_name;
+        detail = span_detail;
+        start = trace_now();
+    }
+    ~TraceSpan(){
+        if(name) trace_record(name, detail, start, trace_now());
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+    const char* name = nullptr;
+    string_view detail;		// must outlive the span
+    uint64_t start = 0;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(...) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
 
-    for(const auto& tok : tokens){
-        if(tok == "|"){
-            stages.push_back(current);
-            current.clear();
-        } 
-		else{
-            current.push_back(tok);
+// Helper: The buffered spans as Chrome trace-event JSON, oldest first
+string trace_json(){
+    string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    uint64_t end = trace_next.load(memory_order_acquire);
+    uint64_t begin = max(trace_first.load(), end > TRACE_CAPACITY ? end-TRACE_CAPACITY : 0);
+    string pid = to_string(getpid());
+    char num[96];
+    bool first = true;
+    for(uint64_t i = begin; i < end; i++){
+        const TraceEvent& e = trace_ring[i & (TRACE_CAPACITY-1)];
+        if(e.seq.load(memory_order_acquire) != i+1) continue;
+        const char* name = e.name;
+        uint64_t start = e.start_ns, dur = e.dur_ns;
+        uint32_t tid = e.tid;
+        char detail[sizeof(e.detail)];
+        memcpy(detail, e.detail, sizeof(detail));
+        atomic_thread_fence(memory_order_acquire);
+        if(e.seq.load(memory_order_relaxed) != i+1) continue;		// overwritten while copying
+
+        json += first ? "\n" : ",\n";
+        first = false;
+        json += "{\"name\":\"";
+        json += name;
+        snprintf(num, sizeof num, "\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"tid\":%u,\"pid\":",
+                 start/1e3, dur/1e3, tid);
+        json += num;
+        json += pid;
+        if(detail[0]){
+            json += ",\"args\":{\"detail\":\"";
+            json_escape(detail, json);
+            json += "\"}";
         }
+        json += "}";
     }
-    stages.push_back(current);
-    return stages;
+    json += "\n]}\n";
+    return json;
+}
+
+// Helper: At exit, writes the trace to the SHELL_TRACE file
+void write_trace_file(){
+    if(trace_file.empty() || getpid() != trace_owner) return;
+    ofstream out(trace_file);
+    out<<trace_json();
+    if(!out) perror(trace_file.c_str());
 }
+#else
+#define TRACE_SPAN(...) ((void)0)
+#endif
 
 // ------------------------------------------------------------
-// Tab auto-completion
+// Shell variables
 // ------------------------------------------------------------
-int handle_tab(int, int) {
-    static string last_buffer;
-    static bool tab_pressed_before = false;
-
-    string buffer = rl_line_buffer;
+/* Every variable lives in one open-addressing table (linear probing,
+   power-of-two capacity, tombstones on unset), so a $NAME lookup is a
+   hash and usually a single probe with no per-lookup allocation.
+   Exported variables are also handed to children; the envp array is
+   rebuilt only after one of them changed, not on every spawn. */
+class VariableTable {
+public:
+    struct Var {
+        string name;
+        string value;
+        bool exported = false;
+    };
 
-    // Only complete first word
-    if(buffer.find(' ') != string::npos){
-        cout<<"\a"<<flush;
-        tab_pressed_before = false;
-        return 0;
+    const Var* find(string_view name) const {
+        size_t i = slot_of(name);
+        return i == NONE ? nullptr : &slots[i].var;
     }
 
-    // Reset TAB state if buffer changed
-    if(buffer != last_buffer){
-        tab_pressed_before = false;
-        last_buffer = buffer;
+    // Sets a value, keeping the exported flag of an existing variable
+    void set(string_view name, string_view value, bool exported = false){
+        Var& var = insert(name);
+        var.value.assign(value.data(), value.size());
+        if(exported) var.exported = true;
+        if(var.exported) env_generation++;
     }
 
-    //---------------- BUILTINS FIRST ---------------- 
-    vector<string> builtin_matches;
-
-    for(const auto& b : builtins){
-        if(b.rfind(buffer, 0)==0){
-            builtin_matches.push_back(b);
+    void set_exported(string_view name){
+        Var& var = insert(name);
+        if(!var.exported){
+            var.exported = true;
+            env_generation++;
         }
     }
 
-    if(builtin_matches.size() == 1){
-        string suffix = builtin_matches[0].substr(buffer.size());
-        rl_insert_text(suffix.c_str());
-        rl_insert_text(" ");
-        rl_redisplay();
-        tab_pressed_before = false;
-        return 0;
+    bool erase(string_view name){
+        size_t i = slot_of(name);
+        if(i == NONE) return false;
+        if(slots[i].var.exported) env_generation++;
+        slots[i].state = DELETED;
+        slots[i].var = Var();
+        used--;
+        tombstones++;
+        return true;
     }
 
-    //---------------- PATH EXECUTABLES ----------------
-    vector<string> matches;
-    char* path_env = getenv("PATH");
+    void clear(){
+        slots.clear();
+        used = tombstones = 0;
+        env_generation++;
+    }
 
-    if(path_env){
-        vector<string> dirs = split_path(path_env);
+    template<class F>
+    void for_each(F f) const {
+        for(const auto& s : slots){
+            if(s.state == USED) f(s.var);
+        }
+    }
 
-        for(const auto& dir : dirs){
-            if(!filesystem::exists(dir) || !filesystem::is_directory(dir)) continue;
+    unsigned long generation() const { return env_generation; }
 
-            for(const auto& entry : filesystem::directory_iterator(dir)){
-                if(!entry.is_regular_file()) continue;
+private:
+    enum State : unsigned char { EMPTY, USED, DELETED };
+    struct Slot {
+        Var var;
+        State state = EMPTY;
+    };
+    vector<Slot> slots;
+    size_t used = 0;
+    size_t tombstones = 0;
+    unsigned long env_generation = 1;	// bumped whenever the exported set changes
+    static constexpr size_t NONE = ~size_t(0);
 
-                auto perms = entry.status().permissions();
-                bool exec =
-                    (perms & filesystem::perms::owner_exec) != filesystem::perms::none ||
-                    (perms & filesystem::perms::group_exec) != filesystem::perms::none ||
-                    (perms & filesystem::perms::others_exec) != filesystem::perms::none;
+    // FNV-1a
+    static size_t hash_name(string_view name){
+        size_t h = 1469598103934665603ULL;
+        for(unsigned char c : name){
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
 
-                if(!exec) continue;
+    // Rehash into a table sized for the live entries, dropping tombstones
+    void grow(){
+        size_t capacity = 16;
+        while(capacity < (used+1)*2) capacity *= 2;
+        vector<Slot> old;
+        old.swap(slots);
+        slots.resize(capacity);
+        tombstones = 0;
+        size_t mask = capacity-1;
+        for(auto& s : old){
+            if(s.state != USED) continue;
+            size_t i = hash_name(s.var.name) & mask;
+            while(slots[i].state == USED) i = (i+1) & mask;
+            slots[i].var = std::move(s.var);
+            slots[i].state = USED;
+        }
+    }
 
-                string name = entry.path().filename().string();
-                if(name.rfind(buffer, 0) == 0){
-                    matches.push_back(name);
-                }
-            }
+    size_t slot_of(string_view name) const {
+        if(slots.empty()) return NONE;
+        size_t mask = slots.size()-1;
+        for(size_t i = hash_name(name) & mask; ; i = (i+1) & mask){
+            if(slots[i].state == EMPTY) return NONE;
+            if(slots[i].state == USED && slots[i].var.name == name) return i;
         }
     }
 
-    if(matches.empty()){
-        cout<<"\a"<<flush;
-        tab_pressed_before = false;
-        return 0;
+    Var& insert(string_view name){
+        size_t found = slot_of(name);
+        if(found != NONE) return slots[found].var;
+        // at most 3/4 full counting tombstones, so probes always reach an EMPTY slot
+        if((used+tombstones+1)*4 > slots.size()*3) grow();
+        size_t mask = slots.size()-1;
+        size_t i = hash_name(name) & mask;
+        while(slots[i].state == USED) i = (i+1) & mask;
+        if(slots[i].state == DELETED) tombstones--;
+        slots[i].state = USED;
+        slots[i].var.name.assign(name.data(), name.size());
+        used++;
+        return slots[i].var;
     }
+};
 
-    sort(matches.begin(), matches.end());
-    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+static VariableTable variables;
+static unsigned long envp_generation = 0;	// table generation env_strings was built from
+static vector<string> env_strings;			// NAME=VALUE of every exported variable
+static vector<char*> env_pointers;
+static pid_t last_background_pid = 0;		// $!
+static string shell_name = "shell";			// $0 (there are no other positional parameters)
 
-    //---------------- UNIQUE MATCH LOGIC ----------------
-    if(matches.size() == 1){
-    	string full = matches[0]+" ";
+// Helper: Value of a shell variable, nullptr if unset (valid until the next change)
+const string* get_var(string_view name){
+    const VariableTable::Var* var = variables.find(name);
+    return var ? &var->value : nullptr;
+}
 
-    	rl_point = rl_end = 0; // reset buffer
-    	rl_insert_text(full.c_str());
-    	rl_redisplay();
+// Helper: Value of a shell variable, empty if unset
+string var_value(string_view name){
+    const string* value = get_var(name);
+    return value ? *value : string();
+}
 
-    	tab_pressed_before = false;
-    	return 0;
-	}
+// Helper: Checks for a valid variable name: [A-Za-z_][A-Za-z0-9_]*
+bool is_var_name(string_view name){
+    if(name.empty() || isdigit(static_cast<unsigned char>(name[0]))) return false;
+    for(char c : name){
+        if(!isalnum(static_cast<unsigned char>(c)) && c!='_') return false;
+    }
+    return true;
+}
 
-	//---------- LCP EXTENSION ----------
-    string lcp = longest_common_prefix(matches);
+// Helper: Loads the inherited environment as exported variables
+void import_environment(){
+    extern char** environ;
+    for(char** e = environ; e && *e; e++){
+        const char* eq = strchr(*e, '=');
+        if(eq && eq > *e) variables.set(string_view(*e, eq-*e), eq+1, true);
+    }
+}
 
-    if(lcp.size() > buffer.size()){
-        string suffix = lcp.substr(buffer.size());
-        rl_insert_text(suffix.c_str());
-        rl_redisplay();
-        tab_pressed_before = false;
-        return 0;
+/* Helper:
+		The environment handed to children, rebuilt from the exported
+		variables only when they changed since the last spawn. */
+char** shell_envp(){
+    if(envp_generation != variables.generation()){
+        env_strings.clear();
+        variables.for_each([](const VariableTable::Var& var){
+            if(var.exported) env_strings.push_back(var.name+"="+var.value);
+        });
+        env_pointers.clear();
+        for(auto& s : env_strings) env_pointers.push_back(s.data());
+        env_pointers.push_back(nullptr);
+        envp_generation = variables.generation();
     }
+    return env_pointers.data();
+}
 
-	//---------- DOUBLE TAB LISTING ----------
-	if(!tab_pressed_before){
-		cout<<"\a"<<flush;
-		tab_pressed_before = true;
-	} 
-	else{
-		cout<<"\n";
-		for(size_t i=0; i<matches.size(); i++){
-			cout<<matches[i];
-			if(i+1<matches.size()) cout << "  ";
-		}
-		cout<<"\n$ ";
-		cout.flush();
+// ------------------------------------------------------------
+// Command hash table (name -> absolute path)
+// ------------------------------------------------------------
+struct HashedCommand {
+    string path;
+    int hits = 0;
+};
+static unordered_map<string, HashedCommand> command_hash;
+static recursive_mutex command_hash_mutex;	// builtin pipeline stages run on threads
+static string hashed_path_env;	// PATH the table was filled against
 
-		// restore readline state
-		rl_insert_text(buffer.c_str());
-		rl_redisplay();
+// Helper: Drops every hashed entry if PATH changed since they were cached
+void sync_command_hash(){
+    const string* path_env = get_var("PATH");
+    if(!path_env ? !hashed_path_env.empty() : *path_env != hashed_path_env){
+        command_hash.clear();
+        hashed_path_env = path_env ? *path_env : "";
+    }
+}
 
-		tab_pressed_before = false;
-	}
-    return 0;
+// Helper: Checks that a path names an executable regular file
+bool is_executable_file(const string& path){
+    struct stat st;
+    return stat(path.c_str(), &st)==0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK)==0;
 }
 
-// ------------------------------------------------------------
-// Execute pipeline builtin
-// ------------------------------------------------------------
-void execute_builtin(vector<string>& tokens){
-    if(tokens[0] == "echo"){
-        for(size_t i=1; i<tokens.size(); i++){
-            cout<<tokens[i];
-            if(i+1<tokens.size()) cout << " ";
-        }
-        cout<<endl;
-    }
-	else if(tokens[0] == "history"){
-		if(tokens.size()==3 && tokens[1]=="-r"){
-			std::ifstream file(tokens[2]);
-			if(!file.is_open()) return ;
-			string line;
-			while(getline(file, line)){
-				if(line.empty()) continue;
-				add_history(line.c_str());
-			}
-			return;
-		}
-		else if(tokens.size()==3 && tokens[1]=="-w"){
-			std::ofstream file(tokens[2]);
-			if(!file.is_open()){
-				cerr<<"History cannot write to "<<tokens[2]<<endl;
-				return;
-			}
-			int len = history_length;
-			for(int i=1; i<=len; i++){
-        		HIST_ENTRY* entry = history_get(i);
-        		if(entry && entry->line){
-        			file<<entry->line<<endl;
-        		}
-    		}
-			return;
-		}
-		else if(tokens.size()==3 && tokens[1]=="-a"){
-			std::ofstream file(tokens[2], std::ios::app);
-			if(!file.is_open()){
-				cerr<<"History cannot write to "<<tokens[2]<<endl;
-				return;
-			}
-			int len = history_length;
-			for(int i=last_history_written+1; i<=len; i++){
-        		HIST_ENTRY* entry = history_get(i);
-        		if(entry && entry->line){
-            		file<<entry->line<<endl;
-        		}
-    		}
-			last_history_written = len;
-			return;
-		}
+// Helper: Walks PATH for a command, bypassing the hash table
+string search_path(const string& name){
+    const string* path_env = get_var("PATH");
+    if(!path_env) return "";
+    for(const auto& dir : split_path(*path_env)){
+        string full = (dir.empty() ? "." : dir)+"/"+name;
+        if(is_executable_file(full)) return full;
+    }
+    return "";
+}
 
-		int len = history_length;
-		int n = len;
-		if(tokens.size() == 2){
-			n = stoi(tokens[1]);
-			if(n<0) n=0;
-		}
-		int start = max(1, len-n+1);
-    	for(int i=start; i<=len; i++){
-        	HIST_ENTRY* entry = history_get(i);
-        	if(entry && entry->line){
-        		cout<<"    "<<i<<"  "<<entry->line<<endl;
-        	}
-    	}
-	}
-    else if(tokens[0] == "type"){
-        if(tokens.size() < 2) return;
-        if(is_builtin(tokens[1])){
-            cout<<tokens[1]<<" is a shell builtin"<<endl;
-        } 
-		else{
-            char* path = getenv("PATH");
-            if(!path){
-                cout<<tokens[1] << ": not found\n";
-                return;
-            }
-            vector<string> dirs = split_path(path);
-            for(auto& dir : dirs){
-                string full = dir+"/"+tokens[1];
-                if(access(full.c_str(), X_OK) == 0){
-                    cout << tokens[1] << " is " << full << endl;
-                    return;
-                }
-            }
-            cout << tokens[1] << ": not found\n";
+/* Helper:
+		Resolves a command name to the file that would be executed.
+		Names containing a '/' are used as-is; everything else is
+		answered from the hash table, falling back to a PATH walk
+		whose result is remembered. Returns "" when not found. */
+string find_command(string_view name){
+    string key(name);
+    if(name.find('/') != string_view::npos){
+        return is_executable_file(key) ? key : "";
+    }
+    TRACE_SPAN("path_search", name);
+    lock_guard<recursive_mutex> lock(command_hash_mutex);
+    sync_command_hash();
+    auto it = command_hash.find(key);
+    if(it != command_hash.end()){
+        it->second.hits++;
+        return it->second.path;
+    }
+    string full = search_path(key);
+    if(!full.empty()){
+        command_hash[key] = {full, 1};
+    }
+    return full;
+}
+
+/* Helper:
+		Creates a pipe whose ends close on exec. The parent reads it after
+		fork: EOF means the child exec'd, a byte means the hashed path was
+		stale and the entry should be forgotten. */
+bool make_stale_pipe(int fds[2]){
+    if(pipe(fds) == -1) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+// Helper: Parent side of make_stale_pipe; drops the entry if the child reported ENOENT
+void check_stale_pipe(int fds[2], string_view name){
+    if(fds[0] < 0) return;
+    close(fds[1]);
+    char c;
+    if(read(fds[0], &c, 1) == 1){
+        lock_guard<recursive_mutex> lock(command_hash_mutex);
+        command_hash.erase(string(name));
+    }
+    close(fds[0]);
+}
+
+/* Helper:
+		Replaces the current (child) process with an external command.
+		A hashed path that no longer exists fails with ENOENT, in which
+		case the parent is told through stale_fd and PATH is searched
+		again through execvp. A file without a #! line (ENOEXEC) is run
+		by /bin/sh, as execvp does. A file that exists but can't be run
+		exits 126, one that doesn't 127. */
+[[noreturn]] void exec_command(const string& path, const vector<string_view>& args, int stale_fd = -1){
+    auto argv = make_argv(args);
+    if(!path.empty()){
+        execv(path.c_str(), argv.data());
+        if(errno == ENOENT && stale_fd >= 0){
+            (void)!write(stale_fd, "x", 1);
+        }
+        if(errno == ENOEXEC){
+            vector<char*> script = {const_cast<char*>("sh"), const_cast<char*>(path.c_str())};
+            script.insert(script.end(), argv.begin()+1, argv.end());
+            execv("/bin/sh", script.data());
+            errno = ENOEXEC;
         }
     }
-    else if(tokens[0] == "pwd"){
-        cout<<filesystem::current_path().string()<<endl;
+    if(path.empty() || errno == ENOENT){
+        execvp(argv[0], argv.data());
     }
+    if(errno == ENOENT){
+        cout << args[0] << ": command not found\n";
+        exit(127);
+    }
+    cerr << args[0] << ": " << strerror(errno) << "\n";
+    exit(126);
 }
 
 // ------------------------------------------------------------
-// Multi command (|) pipeline execution
+// Shell state
 // ------------------------------------------------------------
-void execute_pipeline_multi(vector<vector<string>>& stages) {
-    int n = stages.size();
-    vector<pid_t> pids;
+static int last_status = 0;				// exit status of the last command
+static bool interactive = false;		// readline REPL vs. -c / script / piped input
+static bool exit_requested = false;		// set by the exit builtin
+static bool substitution_ran = false;	// a $(...) ran while expanding the current line
 
-    // Create N-1 pipes
-    vector<vector<int>> pipes(n-1, vector<int>(2));
-    for(int i=0; i<n-1; i++){
-        if(pipe(pipes[i].data()) == -1){
-            perror("pipe");
-            return;
-        }
-    }
+/* Helper:
+		Flushes the shell's own buffered output. Outside interactive
+		mode stdout is fully buffered, so this must run before another
+		process (or a dup2) takes over the same descriptors. */
+void flush_output(){
+    cout.flush();
+    cerr.flush();
+}
 
-    for(int i=0; i<n; i++){
-        pid_t pid = fork();
-        if(pid == 0){
-            // ---------- CHILD ----------
-            // stdin from previous pipe
-            if(i>0){
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            }
+// ------------------------------------------------------------
+// Process spawning
+// ------------------------------------------------------------
+// posix_spawn avoids copying the shell's page tables (glibc implements it
+// with clone(CLONE_VM|CLONE_VFORK)); fork is kept as a runtime fallback.
+static atomic<bool> use_posix_spawn{true};
+static atomic<bool> use_zero_copy{true};		// the in-process cat copies files (see Kernel-side copies)
 
-            // stdout to next pipe
-            if(i<n-1){
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
+// Options toggled with `set -o name` / `set +o name`; atomic, as pipeline stages on threads read them
+struct ShellOption {
+    const char* name;
+    atomic<bool>* value;
+};
+static ShellOption shell_options[] = {
+    {"posixspawn", &use_posix_spawn},
+    {"zerocopy", &use_zero_copy},
+#ifdef SHELL_TRACE
+    {"trace", &trace_enabled},
+#endif
+};
 
-            // close all pipe fds
-            for(auto& p : pipes){
-                close(p[0]);
-                close(p[1]);
-            }
+// fds to install as the child's stdin/stdout/stderr (-1 = inherit), plus
+// descriptors (other pipe ends) the child must not keep open
+struct SpawnIO {
+    int in = -1;
+    int out = -1;
+    int err = -1;
+    vector<int> close_fds;
+    pid_t pgid = -1;		// process group to join: -1 = the shell's, 0 = a new one
+    int tty = -1;			// terminal whose foreground group the child takes over
+    char** envp = nullptr;	// environment: nullptr = the exported variables
+    int cgroup = -1;		// cgroup directory the child starts in (SHELL_CGROUP): -1 = the shell's
+};
 
-            // builtin or external
-            if(is_builtin(stages[i][0])){
-                execute_builtin(stages[i]);
-                exit(0);
-            }
+// Signals the shell ignores or handles itself; children get the default action back
+const int child_default_signals[] = {SIGPIPE, SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
 
-            auto argv = make_argv(stages[i]);
-            execvp(argv[0], argv.data());
-            perror("execvp");
-            exit(1);
-        }
+bool cgroup_write(int dir, const char* file, string_view value);
+
+// Helper: Child side of a fork-based spawn: join the job's cgroup and group, restore signals, wire up fds
+void apply_spawn_io(const SpawnIO& io){
+    if(io.cgroup >= 0) cgroup_write(io.cgroup, "cgroup.procs", "0");	// failing that, it runs in the shell's
+    if(io.pgid >= 0) setpgid(0, io.pgid);
+    if(io.tty >= 0) tcsetpgrp(io.tty, getpgrp());	// SIGTTOU still ignored here
+    for(int sig : child_default_signals) signal(sig, SIG_DFL);
+    if(io.in >= 0) dup2(io.in, STDIN_FILENO);
+    if(io.out >= 0) dup2(io.out, STDOUT_FILENO);
+    if(io.err >= 0) dup2(io.err, STDERR_FILENO);
+    for(int fd : io.close_fds) close(fd);
+}
+
+// Helper: posix_spawn with the redirections/pipe ends expressed as file actions
+pid_t posix_spawn_command(const string& path, const vector<string_view>& args, const SpawnIO& io, int& error){
+    TRACE_SPAN("posix_spawn", args[0]);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // before the dup2s, while fd io.tty is still the terminal
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    if(io.tty >= 0) posix_spawn_file_actions_addtcsetpgrp_np(&actions, io.tty);
+#endif
+    if(io.in >= 0) posix_spawn_file_actions_adddup2(&actions, io.in, STDIN_FILENO);
+    if(io.out >= 0) posix_spawn_file_actions_adddup2(&actions, io.out, STDOUT_FILENO);
+    if(io.err >= 0) posix_spawn_file_actions_adddup2(&actions, io.err, STDERR_FILENO);
+    for(int fd : io.close_fds) posix_spawn_file_actions_addclose(&actions, fd);
 
-        pids.push_back(pid);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    for(int sig : child_default_signals) sigaddset(&defaults, sig);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if(io.pgid >= 0){
+        posix_spawnattr_setpgroup(&attr, io.pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
     }
+#ifdef POSIX_SPAWN_SETCGROUP
+    if(io.cgroup >= 0){
+        posix_spawnattr_setcgroup_np(&attr, io.cgroup);		// clone3(CLONE_INTO_CGROUP)
+        flags |= POSIX_SPAWN_SETCGROUP;
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
 
-    // ---------- PARENT ----------
-    for(auto& p : pipes){
-        close(p[0]);
-        close(p[1]);
+    auto argv = make_argv(args);
+    pid_t pid = -1;
+    error = posix_spawn(&pid, path.c_str(), &actions, &attr, argv.data(), io.envp ? io.envp : shell_envp());
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return error == 0 ? pid : -1;
+}
+
+static thread_local int spawn_failure_status = 127;	// 126: found but couldn't be run
+
+/* Helper:
+		Starts an external command with the given stdio wiring and returns
+		its pid, or -1 after reporting why it could not be started (the
+		status for that is left in spawn_failure_status). The
+		command is resolved through the hash table; a stale hashed path
+		is forgotten and PATH searched once more. */
+pid_t spawn_command(const vector<string_view>& args, const SpawnIO& io){
+    spawn_failure_status = 127;
+    if(args.empty()) return -1;		// a stage of redirections or assignments only: nothing to start
+    TRACE_SPAN("spawn", args[0]);
+    flush_output();
+    string path = find_command(args[0]);
+    // a path to a file that can't be run is tried anyway, for its real error (and 126)
+    if(path.empty() && args[0].find('/') != string_view::npos && access(string(args[0]).c_str(), F_OK) == 0) path = args[0];
+    if(path.empty()){
+        cout<<args[0]<<": command not found\n";
+        return -1;
+    }
+
+    // before glibc 2.41 posix_spawn can't start a child in a cgroup; the fork path joins it before exec
+#ifdef POSIX_SPAWN_SETCGROUP
+    bool fork_for_cgroup = false;
+#else
+    bool fork_for_cgroup = io.cgroup >= 0;
+#endif
+    if(!use_posix_spawn || fork_for_cgroup){
+        int stale[2] = {-1, -1};
+        make_stale_pipe(stale);
+        char** envp = io.envp ? io.envp : shell_envp();
+        pid_t pid;
+        {
+            TRACE_SPAN("fork", args[0]);
+            pid = fork();
+        }
+        if(pid == 0){
+            extern char** environ;
+            environ = envp;		// exec*() and execvp's PATH search use it
+            apply_spawn_io(io);
+            exec_command(path, args, stale[1]);
+        }
+        if(pid < 0){
+            perror("fork");
+            if(stale[0] >= 0){
+                close(stale[0]);
+                close(stale[1]);
+            }
+            return -1;
+        }
+        if(io.pgid >= 0) setpgid(pid, io.pgid ? io.pgid : pid);
+        check_stale_pipe(stale, args[0]);
+        return pid;
     }
 
-    for(pid_t pid : pids){
-        waitpid(pid, nullptr, 0);
+    int error = 0;
+    pid_t pid = posix_spawn_command(path, args, io, error);
+    if(error == ENOENT && args[0].find('/') == string_view::npos){
+        {
+            lock_guard<recursive_mutex> lock(command_hash_mutex);
+            command_hash.erase(string(args[0]));
+        }
+        path = find_command(args[0]);
+        if(!path.empty()) pid = posix_spawn_command(path, args, io, error);
+    }
+    // posix_spawn has no execvp-style fallback: a file without #! is a /bin/sh script
+    if(error == ENOEXEC){
+        vector<string_view> script = {"sh", path};
+        script.insert(script.end(), args.begin()+1, args.end());
+        pid = posix_spawn_command("/bin/sh", script, io, error);
+        if(error == ENOENT) error = ENOEXEC;
+    }
+    if(pid < 0){
+        if(error != ENOENT) spawn_failure_status = 126;
+        if(error == ENOENT) cout<<args[0]<<": command not found\n";
+        else cerr<<args[0]<<": "<<strerror(error)<<"\n";
     }
+    return pid;
 }
 
 // ------------------------------------------------------------
-// Main Shell Loop (REPL)
+// Resource accounting (time keyword, SHELL_METRICS_LOG)
 // ------------------------------------------------------------
-int main(){
-	cout<<"[MY CUSTOM SHELL IS RUNNING]\n";
+// CPU time and peak memory of the processes reaped for a command or job
+struct Usage {
+    double user = 0;		// seconds
+    double sys = 0;
+    long maxrss = 0;		// KiB, largest single process
+    long memory_peak = 0;	// KiB, the job's cgroup as a whole (SHELL_CGROUP only)
 
-  	// Flush after every std::cout / std:cerr
-	cout << std::unitbuf;
-  	cerr << std::unitbuf;
+    void add(const struct rusage& ru){
+        user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6;
+        sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+        maxrss = max(maxrss, static_cast<long>(ru.ru_maxrss));
+    }
 
-	// ------------------------------------------------------------
-	// Load history from HISTFILE on startup
-	// ------------------------------------------------------------
-	char* histfile = getenv("HISTFILE");
-	if(histfile){
-		std::ifstream file(histfile);
-		if(file.is_open()){
-			std::string line;
-			while(std::getline(file, line)){
-				if(line.empty()) continue;
-				add_history(line.c_str());
-			}
-			last_history_written = history_length;
-		}
-	}
-	
+    void add(const Usage& other){
+        user += other.user;
+        sys += other.sys;
+        maxrss = max(maxrss, other.maxrss);
+        memory_peak = max(memory_peak, other.memory_peak);
+    }
+};
+using Clock = chrono::steady_clock;
 
-  	// Bind tab key for auto completion
-  	rl_bind_key('\t', handle_tab);
+static Usage command_usage;			// children reaped for the current foreground line
+static int metrics_fd = -1;			// SHELL_METRICS_LOG, opened at startup
 
-	// process the input
-	while(1){
-		char* raw = readline("$ ");
-    	if(!raw) break;  
-    	string input(raw);
-    	free(raw);
-    	if(input.empty()) continue;
-    	add_history(input.c_str());
-
-    	// Tokenize input
-    	vector<string> tokens = parse_input(input);
-
-    	// Redirection state
-    	string output_file;
-    	string out_file, err_file;
-    	bool redirect_out = false;
-    	bool redirect_err = false;
-    	bool append_out = false;
-    	bool append_err = false;
-		bool has_pipe = false;
-
-    	// ------------------------------------------------------------
-    	// Handle I/O Redirection
-    	// ------------------------------------------------------------
-		for(size_t i=0; i<tokens.size(); i++){
-			if(tokens[i]==">>" || tokens[i]=="1>>"){
-        		redirect_out = true;
-        		append_out = true;
-        		out_file = tokens[i+1];
-        		tokens.erase(tokens.begin()+i, tokens.begin()+i+2);
-        		i--;
-    		}
-    		else if(tokens[i]=="2>>"){
-    			redirect_err = true;
-        		append_err = true;
-        		err_file = tokens[i+1];
-        		tokens.erase(tokens.begin()+i, tokens.begin()+i+2);
-        		i--;
-      		}
-      		else if(tokens[i]==">" || tokens[i]=="1>"){
-        		redirect_out = true;
-        		append_out = false;
-        		out_file = tokens[i+1];
-        		tokens.erase(tokens.begin()+i, tokens.begin()+i+2);
-        		i--;
-      		}
-      		else if(tokens[i]=="2>"){
-        		redirect_err = true;
-        		append_err = false;
-        		err_file = tokens[i+1];
-        		tokens.erase(tokens.begin()+i, tokens.begin()+i+2);
-        		i--;
-      		}
-			else if(tokens[i]=="|"){
-				has_pipe = true;
-				break;
-			}
-    	}
-		
-		// ------------------------------------------------------------
-    	// Handle pipeline execution (cmd1 | cmd2)
-    	// ------------------------------------------------------------
-		if(has_pipe==true){
-			auto stages = split_pipeline(tokens);
-    		execute_pipeline_multi(stages);
-    		continue;
-		}
+double seconds_since(Clock::time_point start){
+    return chrono::duration<double>(Clock::now()-start).count();
+}
 
-    	// ------------------------------------------------------------
-    	// Apply Redirection (save original FDs)
-    	// ------------------------------------------------------------
-    	int saved_stdout = -1;
-    	int saved_stderr = -1;
-
-    	if(redirect_out){
-      		int fd = open(out_file.c_str(), O_WRONLY | O_CREAT | (append_out ? O_APPEND : O_TRUNC), 0644);
-      		if(fd<0){ 
-        		perror("open"); 
-        		continue; 
-      		}
-      		saved_stdout = dup(STDOUT_FILENO);
-      		dup2(fd, STDOUT_FILENO);
-      		close(fd);
-    	}
+// Helper: bash-style "0m1.234s"
+string format_minutes(double secs){
+    char buf[64];
+    long minutes = static_cast<long>(secs/60);
+    snprintf(buf, sizeof buf, "%ldm%.3fs", minutes, secs-minutes*60);
+    return buf;
+}
 
-    	if(redirect_err){
-    		int fd = open(err_file.c_str(), O_WRONLY | O_CREAT | (append_err ? O_APPEND : O_TRUNC), 0644);
-    	  	if(fd<0){ 
-    	    	perror("open"); 
-    	    	continue;
-    	  	}
-    	  	saved_stderr = dup(STDERR_FILENO);
-    	  	dup2(fd, STDERR_FILENO);
-    	  	close(fd);
-    	}
+/* Helper:
+		Runs f and returns its wall-clock time; usage gets the CPU time
+		of the children reaped meanwhile (wait4) plus the shell's own
+		share for in-process builtins. Nests: the children also count
+		toward an enclosing measurement. */
+template<class F>
+double measure(Usage& usage, F f){
+    Usage outer = command_usage;
+    command_usage = Usage();
+    struct rusage self_before, self_after;
+    getrusage(RUSAGE_SELF, &self_before);
+    Clock::time_point started = Clock::now();
 
-    	// ------------------------------------------------------------
-    	// Built-in Command Handling
-    	// ------------------------------------------------------------
-	
-    	// exit: terminate shell
-    	if(tokens[0]=="exit"){
-			if(tokens[0] == "exit"){
-				// Auto-save history to HISTFILE on exit
-				char* histfile = getenv("HISTFILE");
-				if(histfile){
-					std::ofstream file(histfile);
-					if(file.is_open()){
-						int len = history_length;
-						for(int i=1; i<=len; i++){
-							HIST_ENTRY* entry = history_get(i);
-							if(entry && entry->line){
-								file<<entry->line<<endl;
-							}
-						}
-					}
-				}
-				return 0;
-			}
-		}
+    f();
 
-    	//empty input: new input req.
-    	if(tokens.empty()){
-    	  	continue;
-    	}
+    double real = seconds_since(started);
+    getrusage(RUSAGE_SELF, &self_after);
+    usage = command_usage;
+    command_usage = outer;
+    command_usage.add(usage);
+    usage.user += (self_after.ru_utime.tv_sec-self_before.ru_utime.tv_sec) + (self_after.ru_utime.tv_usec-self_before.ru_utime.tv_usec)/1e6;
+    usage.sys += (self_after.ru_stime.tv_sec-self_before.ru_stime.tv_sec) + (self_after.ru_stime.tv_usec-self_before.ru_stime.tv_usec)/1e6;
+    if(usage.maxrss == 0) usage.maxrss = self_after.ru_maxrss;	// builtins only: the shell's own peak
+    return real;
+}
 
-    	// echo: print arguments
-    	else if(tokens[0]=="echo"){
-    	  	for(size_t i=1; i<tokens.size(); i++){
-    	    	cout<<tokens[i];
-    	    	if(i+1<tokens.size()) cout<<" ";
-    	  	}
-    	  	cout<<endl;
-    	}
+// Helper: The report printed by the time keyword (to stderr, as in other shells)
+void print_time_report(double real, const Usage& usage){
+    flush_output();
+    cerr<<"\nreal\t"<<format_minutes(real)<<"\n"
+        <<"user\t"<<format_minutes(usage.user)<<"\n"
+        <<"sys\t"<<format_minutes(usage.sys)<<"\n"
+        <<"maxrss\t"<<usage.maxrss<<"K\n";
+    if(usage.memory_peak > 0) cerr<<"mempeak\t"<<usage.memory_peak<<"K\n";
+    cerr.flush();
+}
 
-    	// pwd: print current directory
-    	else if(tokens[0]=="pwd"){
-    		auto full_path = filesystem::current_path();
-    	  	cout<<full_path.string()<<endl;
-    	}
-		
-		// history: past commands
-		else if(tokens[0] == "history"){
-			if(tokens.size()==3 && tokens[1]=="-r"){
-				std::ifstream file(tokens[2]);
-				if(!file.is_open()) continue;
-				string line;
-				while(getline(file, line)){
-					if(line.empty()) continue;
-					add_history(line.c_str());
-				}
-				continue;
-			}
-			else if(tokens.size()==3 && tokens[1]=="-w"){
-				std::ofstream file(tokens[2]);
-				if(!file.is_open()){
-					cerr<<"History cannot write to "<<tokens[2]<<endl;
-					continue;
-				}
-				int len = history_length;
-				for(int i=1; i<=len; i++){
-        			HIST_ENTRY* entry = history_get(i);
-        			if(entry && entry->line){
-            			file<<entry->line<<endl;
-        			}
-    			}
-				continue;
-			}
-			else if(tokens.size()==3 && tokens[1]=="-a"){
-				std::ofstream file(tokens[2], std::ios::app);
-				if(!file.is_open()){
-					cerr<<"History cannot write to "<<tokens[2]<<endl;
-					continue;
-				}
-				int len = history_length;
-				for(int i=last_history_written+1; i<=len; i++){
-        			HIST_ENTRY* entry = history_get(i);
-        			if(entry && entry->line){
-            			file<<entry->line<<endl;
-        			}
-    			}
-				last_history_written = len;
-				continue;
-			}
+/* Helper:
+		Appends one JSON line per finished command to SHELL_METRICS_LOG.
+		The record is built first and written with a single O_APPEND
+		write, so concurrent shells can share one log. */
+void log_metrics(const string& text, int status, double real, const Usage& usage, bool background){
+    if(metrics_fd < 0) return;
+    string line = "{\"time\":";
+    char num[64];
+    snprintf(num, sizeof num, "%.3f", chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count());
+    line += num;
+    line += ",\"pid\":"+to_string(getpid())+",\"command\":\"";
+    json_escape(text, line);
+    snprintf(num, sizeof num, "\",\"status\":%d,\"real\":%.6f,", status, real);
+    line += num;
+    snprintf(num, sizeof num, "\"user\":%.6f,\"sys\":%.6f,", usage.user, usage.sys);
+    line += num;
+    line += "\"maxrss_kb\":"+to_string(usage.maxrss)+",";
+    if(usage.memory_peak > 0) line += "\"memory_peak_kb\":"+to_string(usage.memory_peak)+",";
+    line += string("\"background\":")+(background ? "true" : "false")+"}\n";
+    if(write(metrics_fd, line.data(), line.size()) < 0){
+        // a full disk must not take the shell down; stop logging instead
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+}
 
-			int len = history_length;
-			int n = len;
-			if(tokens.size() == 2){
-				n = stoi(tokens[1]);
-				if(n<0) n=0;
-			}
-			int start = max(1, len-n+1);
-    		for(int i=start; i<=len; i++){
-        		HIST_ENTRY* entry = history_get(i);
-        		if(entry && entry->line){
-            		cout<<"    "<<i<<"  "<<entry->line<<endl;
-        		}
-    		}
+// ------------------------------------------------------------
+// Session and job cgroups (cgroup v2, SHELL_CGROUP)
+// ------------------------------------------------------------
+/* With SHELL_CGROUP=DIR, a cgroup v2 directory delegated to the shell's
+   user, each session gets a cgroup DIR/session-PID holding the session's
+   limits: SHELL_CGROUP_CPU_WEIGHT, SHELL_CGROUP_MEMORY_MAX and
+   SHELL_CGROUP_PIDS_MAX go verbatim into cpu.weight, memory.max and
+   pids.max. Processes may only live in leaves once controllers are
+   enabled, so the shell itself moves to the leaf "shell" and every job
+   gets a leaf "job-N" of its own: a runaway pipeline is held to its
+   session's share, and the job's cpu.stat and memory.peak count all of
+   its processes, reaped or not. A session can't remove the cgroup it is
+   in; the next session started under DIR removes those left behind. */
+static int session_cgroup = -1;		// directory fd of this session's cgroup, -1 without
+
+// Helper: Writes an interface file (cgroup.procs, memory.max, ...); errno tells why not
+bool cgroup_write(int dir, const char* file, string_view value){
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+    bool written = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return written;
+}
+
+// Helper: Contents of a small interface file ("" if it can't be read)
+string cgroup_read(int dir, const char* file){
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return "";
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof buf);
+    close(fd);
+    return n > 0 ? string(buf, n) : "";
+}
+
+// Helper: Value of "key N" in a flat-keyed file such as cpu.stat (-1: no such key)
+long long cgroup_stat(const string& text, string_view key){
+    for(size_t pos = 0; pos < text.size(); ){
+        size_t end = text.find('\n', pos);
+        if(end == string::npos) end = text.size();
+        string_view line(text.data()+pos, end-pos);
+        if(line.size() > key.size() && line.substr(0, key.size()) == key && line[key.size()] == ' '){
+            return atoll(text.c_str()+pos+key.size()+1);
+        }
+        pos = end+1;
+    }
+    return -1;
+}
+
+// Helper: CPU time (cpu.stat) and, with the memory controller, peak memory (memory.peak) of a cgroup
+bool read_cgroup_usage(int dir, Usage& usage){
+    string stat = cgroup_read(dir, "cpu.stat");
+    long long user = cgroup_stat(stat, "user_usec");
+    long long sys = cgroup_stat(stat, "system_usec");
+    if(user < 0 || sys < 0) return false;
+    usage.user = user/1e6;
+    usage.sys = sys/1e6;
+    string peak = cgroup_read(dir, "memory.peak");
+    if(!peak.empty()) usage.memory_peak = atoll(peak.c_str())/1024;
+    return true;
+}
+
+// Helper: Creates the child cgroup prefix+N, from N = first up to the first free name; returns its fd or -1
+int create_cgroup(int parent, const char* prefix, unsigned long first, string& name){
+    for(unsigned long n = first; n < first+1000; n++){
+        name = prefix+to_string(n);
+        if(mkdirat(parent, name.c_str(), 0755) == 0) return openat(parent, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(errno != EEXIST) return -1;
+    }
+    return -1;
+}
+
+// Helper: Removes a cgroup and its descendants (those still holding processes stay)
+void remove_cgroup_tree(int parent, const char* name){
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) return;
+    if(DIR* dir = fdopendir(fd)){
+        while(struct dirent* entry = readdir(dir)){
+            if(entry->d_type == DT_DIR && entry->d_name[0] != '.') remove_cgroup_tree(fd, entry->d_name);
+        }
+        closedir(dir);
+    }
+    else close(fd);
+    unlinkat(parent, name, AT_REMOVEDIR);
+}
+
+// Helper: Removes the cgroups of sessions whose shell has exited (session-PID with PID gone)
+void remove_stale_sessions(int parent){
+    int fd = openat(parent, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if(!dir){
+        if(fd >= 0) close(fd);
+        return;
+    }
+    vector<string> stale;
+    while(struct dirent* entry = readdir(dir)){
+        if(strncmp(entry->d_name, "session-", 8) != 0) continue;
+        pid_t pid = atoi(entry->d_name+8);
+        if(pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) stale.push_back(entry->d_name);
+    }
+    closedir(dir);
+    for(const auto& name : stale) remove_cgroup_tree(parent, name.c_str());
+}
+
+/* Helper:
+		Whether this shell was started inside one of root's session
+		cgroups (a shell run from a session). /proc/self/cgroup gives the
+		path below the cgroup2 mount (or namespace root), root is a
+		directory in it: the path must run through <root>/session-...,
+		not merely contain /session- as systemd's session-N.scope does. */
+bool in_session_cgroup(const string& root){
+    string self = cgroup_read(AT_FDCWD, "/proc/self/cgroup");
+    size_t v2 = self.find("0::");
+    if(v2 == string::npos) return false;
+    string path = self.substr(v2+3, self.find('\n', v2)-v2-3);
+    string dir = root;
+    while(dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    for(size_t k = path.find("/session-"); k != string::npos; k = path.find("/session-", k+1)){
+        string_view above = string_view(path).substr(0, k);
+        // above starts with '/', so a match ends on a component boundary
+        bool under_root = dir.size() >= above.size() && dir.compare(dir.size()-above.size(), above.size(), above) == 0;
+        struct stat st;
+        if(under_root && stat((dir+path.substr(k)).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) return true;
+    }
+    return false;
+}
+
+/* Helper:
+		Creates a session cgroup under the directory path: its limits,
+		the leaf the shell moves into, controllers for the job leaves.
+		Returns its directory fd, -1 (after a warning) on failure. A
+		limit that can't be set is reported; the session goes on. */
+int open_session_cgroup(const string& path, const string& name){
+    int parent = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(parent < 0){
+        cerr<<"SHELL_CGROUP: "<<path<<": "<<strerror(errno)<<"\n";
+        return -1;
+    }
+    remove_stale_sessions(parent);
+    static const char* const controllers[] = {"+cpu", "+memory", "+pids"};
+    // usually done once when DIR is delegated; each one separately, as any may be missing
+    for(const char* controller : controllers) cgroup_write(parent, "cgroup.subtree_control", controller);
+
+    remove_cgroup_tree(parent, name.c_str());		// left over from an earlier process with this pid
+    int session = -1;
+    if(mkdirat(parent, name.c_str(), 0755) == 0) session = openat(parent, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(session < 0){
+        cerr<<"SHELL_CGROUP: "<<path<<"/"<<name<<": "<<strerror(errno)<<"\n";
+        close(parent);
+        return -1;
+    }
+    close(parent);
+
+    static const struct { const char* var; const char* file; } limits[] = {
+        {"SHELL_CGROUP_CPU_WEIGHT", "cpu.weight"}, {"SHELL_CGROUP_MEMORY_MAX", "memory.max"}, {"SHELL_CGROUP_PIDS_MAX", "pids.max"},
+    };
+    for(const auto& limit : limits){
+        const string* value = get_var(limit.var);
+        if(value && !value->empty() && !cgroup_write(session, limit.file, *value)){
+            cerr<<"SHELL_CGROUP: "<<name<<"/"<<limit.file<<": "<<strerror(errno)<<"\n";
+        }
+    }
+    mkdirat(session, "shell", 0755);
+    for(const char* controller : controllers) cgroup_write(session, "cgroup.subtree_control", controller);
+    return session;
+}
+
+// Helper: Moves the shell into a session cgroup's "shell" leaf; from then on its jobs get leaves of their own
+void join_session_cgroup(int session){
+    int leaf = openat(session, "shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(leaf < 0 || !cgroup_write(leaf, "cgroup.procs", "0")){
+        cerr<<"SHELL_CGROUP: cannot join the session's cgroup: "<<strerror(errno)<<"\n";
+        if(leaf >= 0) close(leaf);
+        close(session);
+        return;
+    }
+    close(leaf);
+    session_cgroup = session;
+}
+
+// Helper: SHELL_CGROUP set: this session's cgroup (not again in a shell started from a session)
+void start_session_cgroup(){
+    const string* path = get_var("SHELL_CGROUP");
+    if(!path || path->empty() || session_cgroup >= 0 || in_session_cgroup(*path)) return;
+    int session = open_session_cgroup(*path, "session-"+to_string(getpid()));
+    if(session >= 0) join_session_cgroup(session);
+}
+
+// ------------------------------------------------------------
+// Jobs
+// ------------------------------------------------------------
+struct Job {
+    int id;
+    pid_t pgid = 0;				// 0 until the first process starts
+    vector<pid_t> live;			// started and not yet exited
+    pid_t last_pid = -1;		// its status is the job's status
+    int status = 0;
+    bool stopped = false;
+    bool background = false;
+    bool async = false;			// started with &: reported and logged when it finishes
+    bool timed = false;			// time keyword
+    unsigned long touched = 0;	// recency, for the + / - markers
+    string text;
+    Clock::time_point started = Clock::now();
+    Usage usage;				// of the processes reaped so far
+    int cgroup = -1;			// its cgroup (SHELL_CGROUP), made with its first process: directory fd
+    string cgroup_name;
+};
+static list<Job> jobs;
+static unsigned long job_clock = 0;
+static bool job_control = false;		// interactive: own process groups + terminal handoff
+static pid_t shell_pgid = 0;
+static volatile sig_atomic_t children_changed = 0;
+
+void on_sigchld(int){
+    children_changed = 1;
+}
+
+// Helper: Starts a job entry; processes are added as they are spawned
+Job& create_job(const string& text, bool background){
+    int id = 1;
+    for(const auto& j : jobs) id = max(id, j.id+1);
+    jobs.push_back(Job());
+    Job& job = jobs.back();
+    job.id = id;
+    job.background = background;
+    job.async = background;
+    job.touched = ++job_clock;
+    job.text = text;
+    return job;
+}
+
+// Helper: Process group a job's next process should join (-1: no job control)
+pid_t job_spawn_pgid(const Job& job){
+    return job_control ? job.pgid : -1;
+}
+
+// Helper: Cgroup a job's next process should start in (-1: the shell's)
+int job_spawn_cgroup(Job& job){
+    if(job.cgroup < 0 && session_cgroup >= 0){
+        job.cgroup = create_cgroup(session_cgroup, "job-", job.id, job.cgroup_name);
+        // running out of memory kills the whole job rather than one of its processes
+        if(job.cgroup >= 0) cgroup_write(job.cgroup, "memory.oom.group", "1");
+    }
+    return job.cgroup;
+}
+
+/* Helper:
+		A job is over: its cgroup's totals, which also count processes
+		the shell never reaped (daemons, orphans), top up its usage and,
+		for a foreground job, the current command's; the cgroup goes. */
+void release_job_cgroup(Job& job, bool foreground){
+    if(job.cgroup < 0) return;
+    Usage group;
+    if(read_cgroup_usage(job.cgroup, group)){
+        Usage extra;
+        extra.user = max(0.0, group.user-job.usage.user);
+        extra.sys = max(0.0, group.sys-job.usage.sys);
+        extra.memory_peak = group.memory_peak;
+        job.usage.add(extra);
+        if(foreground) command_usage.add(extra);
+    }
+    close(job.cgroup);
+    job.cgroup = -1;
+    unlinkat(session_cgroup, job.cgroup_name.c_str(), AT_REMOVEDIR);
+}
+
+void add_job_process(Job& job, pid_t pid){
+    if(job.pgid == 0) job.pgid = pid;
+    job.live.push_back(pid);
+    job.last_pid = pid;
+}
+
+// Helper: Applies one wait4() result to the job owning pid
+void update_job_process(Job& job, pid_t pid, int wstatus, const struct rusage& ru){
+    if(WIFSTOPPED(wstatus)){
+        job.stopped = true;
+        job.touched = ++job_clock;
+        return;
+    }
+    if(WIFCONTINUED(wstatus)){
+        job.stopped = false;
+        return;
+    }
+    job.live.erase(remove(job.live.begin(), job.live.end(), pid), job.live.end());
+    job.usage.add(ru);
+    if(pid == job.last_pid){
+        job.status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+    }
+}
+
+// Helper: The job marked + (most recent) or - (the one before it)
+char job_marker(const Job& job){
+    unsigned long first = 0, second = 0;
+    for(const auto& j : jobs){
+        if(j.touched > first){
+            second = first;
+            first = j.touched;
+        }
+        else if(j.touched > second) second = j.touched;
+    }
+    return job.touched == first ? '+' : job.touched == second ? '-' : ' ';
+}
+
+// Helper: A background job finished: time keyword report and metrics log entry
+void finish_async_job(const Job& job){
+    double real = seconds_since(job.started);
+    if(job.timed) print_time_report(real, job.usage);
+    log_metrics(job.text, job.status, real, job.usage, true);
+}
+
+void print_job(const Job& job, const char* state, ostream& out){
+    string padded = state;
+    padded.resize(max<size_t>(padded.size(), 24), ' ');
+    out<<"["<<job.id<<"]"<<job_marker(job)<<"  "<<padded<<job.text<<"\n";
+}
+
+/* Helper:
+		Non-blocking status sweep of every job, run before each prompt
+		once SIGCHLD has fired. Each live pid is polled individually, so
+		children that are waited for elsewhere are never stolen. Finished
+		background jobs are reported and dropped. */
+void reap_jobs(bool notify){
+    if(!children_changed) return;
+    children_changed = 0;
+    for(auto& job : jobs){
+        vector<pid_t> pids = job.live;
+        for(pid_t pid : pids){
+            int wstatus;
+            struct rusage ru;
+            if(wait4(pid, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &ru) == pid){
+                update_job_process(job, pid, wstatus, ru);
+            }
+        }
+    }
+    for(auto it = jobs.begin(); it != jobs.end(); ){
+        if(!it->live.empty()){
+            ++it;
+            continue;
+        }
+        if(notify && it->background){
+            print_job(*it, it->status==0 ? "Done" : ("Exit "+to_string(it->status)).c_str(), cout);
+        }
+        release_job_cgroup(*it, false);
+        if(it->async) finish_async_job(*it);
+        it = jobs.erase(it);
+    }
+}
+
+/* Helper:
+		Waits for a foreground job to finish or stop. Under job control
+		the job's process group owns the terminal meanwhile. A stopped
+		job stays in the table (and is reported); a finished one is
+		removed. Returns the job's status, 128+SIGTSTP if it stopped. */
+int wait_for_job(Job& job, bool foreground){
+    TRACE_SPAN("wait", job.text);
+    int job_id = job.id;
+    foreground = foreground && job_control;
+    if(foreground && job.pgid > 0) tcsetpgrp(STDIN_FILENO, job.pgid);
+
+    while(!job.live.empty() && !job.stopped){
+        pid_t pid = job.live.front();
+        int wstatus;
+        struct rusage ru;
+        if(wait4(pid, &wstatus, WUNTRACED, &ru) < 0){
+            if(errno == EINTR) continue;
+            job.live.erase(job.live.begin());
+            continue;
+        }
+        update_job_process(job, pid, wstatus, ru);
+        if(!WIFSTOPPED(wstatus)) command_usage.add(ru);
+    }
+
+    if(foreground){
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+
+    if(job.stopped){
+        job.background = true;
+        cout<<"\n";
+        print_job(job, "Stopped", cout);
+        return 128+SIGTSTP;
+    }
+    release_job_cgroup(job, true);
+    int status = job.status;
+    if(job.async) finish_async_job(job);
+    jobs.remove_if([job_id](const Job& j){ return j.id == job_id; });
+    return status;
+}
+
+// Helper: Resolves %n, %+ / %% / %, %- (default: current job)
+Job* find_job(string_view spec, ostream& err, const char* builtin){
+    Job* best = nullptr;
+    if(spec.empty() || spec == "%+" || spec == "%%" || spec == "%" || spec == "%-"){
+        char want = spec == "%-" ? '-' : '+';
+        for(auto& j : jobs){
+            if(job_marker(j) == want) best = &j;
+        }
+        if(!best) err<<builtin<<": "<<(spec.empty() ? "current" : string(spec))<<": no such job\n";
+        return best;
+    }
+    string_view num = spec[0] == '%' ? spec.substr(1) : spec;
+    int id = atoi(string(num).c_str());
+    for(auto& j : jobs){
+        if(j.id == id) return &j;
+    }
+    err<<builtin<<": "<<spec<<": no such job\n";
+    return nullptr;
+}
+
+// Helper: Resumes a stopped job (SIGCONT to its whole process group)
+void continue_job(Job& job){
+    if(job.stopped){
+        if(job.pgid > 0) kill(job_control ? -job.pgid : job.pgid, SIGCONT);
+        job.stopped = false;
+    }
+    job.touched = ++job_clock;
+}
+
+/* Helper:
+		Enables job control for the interactive shell: wait until the
+		shell is in the terminal's foreground, put it in its own process
+		group, and ignore the keyboard signals in the shell itself (jobs
+		get them back, see child_default_signals). */
+void init_job_control(){
+    if(!isatty(STDIN_FILENO)) return;
+    while(tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())){
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_control = true;
+}
+
+// ------------------------------------------------------------
+// Lexer / parser
+// ------------------------------------------------------------
+enum class TokenKind { WORD, PIPE, REDIRECT, AMP, AND, OR, SEMI, LPAREN, RPAREN };
+
+// > >> < << <<- <<<
+enum class RedirectOp { WRITE, APPEND, READ, HEREDOC, HEREDOC_STRIP, HERESTRING };
+
+struct Token {
+    TokenKind kind;
+    string_view text;		// WORD only; always NUL-terminated in the arena
+    int fd = 1;				// REDIRECT: descriptor being redirected
+    RedirectOp op = RedirectOp::WRITE;	// REDIRECT only
+    bool expands = false;	// WORD: contains $ references or glob characters (markers)
+    bool assignment = false;	// WORD: NAME=value, with NAME unquoted
+    bool quoted = false;	// WORD: had quotes or escapes (a quoted here-doc delimiter)
+    uint32_t begin = 0;		// source range in the input line
+    uint32_t end = 0;
+};
+
+struct Redirection {
+    int fd;
+    RedirectOp op;
+    string_view target;		// file, here-string word or here-doc delimiter
+    int heredoc = -1;		// HEREDOC*: index into CommandLine::heredocs
+};
+
+// Helper: < << <<- <<<: redirections that feed the command's stdin
+bool is_input_redirection(RedirectOp op){
+    return op != RedirectOp::WRITE && op != RedirectOp::APPEND;
+}
+
+/* A here-document. Its body is the input lines after the one holding
+   the << operator, read when that line is parsed; with an unquoted
+   delimiter $ references and substitutions in it are expanded each
+   time it runs. */
+struct HereDoc {
+    string delimiter;
+    bool strip_tabs = false;	// <<-: leading tabs removed from every line
+    bool expand = true;			// delimiter unquoted
+    string body;
+};
+
+struct Stage {
+    vector<string_view> argv;
+    vector<Redirection> redirs;
+    vector<string_view> assigns;	// leading NAME=value words
+    int subshell = -1;				// ( list ): index into CommandLine::lists, argv empty
+};
+
+// stage | stage ...: one job
+struct Pipeline {
+    vector<Stage> stages;
+    bool timed = false;		// leading time keyword
+    string text;			// source text, for the job table and reports
+};
+
+// pipeline && pipeline || ...: each runs depending on the status before it
+struct AndOr {
+    vector<Pipeline> pipelines;
+    vector<bool> and_ops;	// and_ops[k]: && (else ||) between pipelines k and k+1
+    bool background = false;	// ended by &
+    string text;
+};
+
+// and_or ; and_or & ...
+struct CommandList {
+    vector<AndOr> items;
+};
+
+/* A parsed input line. Every string_view points into `arena`, a single
+   copy of the line that the lexer tokenizes in place, so the words are
+   NUL-terminated and can be passed to exec without copying. Execution
+   never modifies it (expansion works on copies), so one parsed line
+   can be run any number of times. */
+struct CommandLine {
+    unique_ptr<char[]> arena;
+    vector<Token> tokens;
+    vector<CommandList> lists;	// lists[0]: the line itself; the rest are ( subshell ) bodies
+    vector<HereDoc> heredocs;	// in the order their bodies follow the line
+    bool expands = false;		// some word needs parameter or pathname expansion before it runs
+    string error;			// syntax error message, if any
+};
+
+/* An expandable '$' is left in the arena as a marker byte, which tells
+   references outside quotes (whose value is split into fields) from
+   those inside double quotes (kept as one field). */
+const char EXPAND_UNQUOTED = '\x01';
+const char EXPAND_QUOTED = '\x02';
+/* Stands for a removed quote or backslash in a word with references:
+   it ends a bare $NAME ("$A"b, $A\b) and keeps the word as a field
+   even if it expands to nothing ($E"") */
+const char EXPAND_END = '\x0e';
+// Unquoted *, ? and [ likewise become glob markers
+const char GLOB_STAR = '\x03';
+const char GLOB_ONE = '\x04';
+const char GLOB_CLASS = '\x05';
+
+// $(command) and `command` become a marker, the command's text and SUBST_END
+const char SUBST_UNQUOTED = '\x06';
+const char SUBST_QUOTED = '\x07';
+const char SUBST_END = '\x08';
+const char* const EXPANSION_MARKERS = "\x01\x02\x03\x04\x05\x06\x07";
+
+// Helper: The character a glob marker stands for
+char glob_literal_char(char c){
+    return c==GLOB_STAR ? '*' : c==GLOB_ONE ? '?' : c==GLOB_CLASS ? '[' : c;
+}
+
+// Helper: Checks whether '$' followed by c starts a parameter reference
+bool starts_parameter(char c){
+    return isalnum(static_cast<unsigned char>(c)) || c=='_' || c=='{' || c=='?' || c=='#' || c=='$' || c=='!';
+}
+
+// Helper: Checks whether buf[r] starts a command substitution
+bool starts_substitution(const char* buf, size_t r, size_t len){
+    return buf[r]=='`' || (buf[r]=='$' && r+1<len && buf[r+1]=='(');
+}
+
+// Helper: Index of the ')' closing a $( whose text starts at buf[i] (nesting and quotes allowed), or npos
+size_t find_substitution_end(const char* buf, size_t i, size_t len){
+    int depth = 1;
+    while(i < len){
+        char c = buf[i];
+        if(c=='\\') i += 2;
+        else if(c=='\'' || c=='"'){
+            for(i++; i<len && buf[i]!=c; i++){
+                if(c=='"' && buf[i]=='\\') i++;
+            }
+            i++;
+        }
+        else if(c=='(' || c==')'){
+            depth += c=='(' ? 1 : -1;
+            if(depth == 0) return i;
+            i++;
+        }
+        else i++;
+    }
+    return string::npos;
+}
+
+/* Helper:
+		Single-pass lexer over a mutable copy of the line.
+		Quotes and escapes are removed by compacting each word towards
+		its start (the output never outruns the input), and the word is
+		NUL-terminated where its delimiter was. Plain words are not
+		moved at all. Operators are only recognised when unquoted.
+		Handles:
+		- Single quotes
+		- Double quotes
+		- Backslash escaping inside and outside quotes
+		- |  >  >>  and the 1> 1>> 2> 2>> forms
+		- <  <<  <<-  <<<
+		- ;  &  &&  ||  (  )
+		- # comments (only at the start of a word)
+		- $ references, left as EXPAND_UNQUOTED / EXPAND_QUOTED markers
+		- * ? [ glob characters, left as GLOB_* markers
+		- $(...) and `...`, kept as raw text between SUBST_* markers */
+void lex_line(char* buf, size_t len, vector<Token>& tokens){
+    size_t r = 0;				// read cursor: the offset in the original line
+    size_t w = 0;				// write cursor, never past the read cursor
+    size_t word_start = 0;
+    bool in_word = false;
+    bool word_quoted = false;	// quoted words are never operators/fd numbers
+    size_t unquoted_len = 0;	// length of the word before its first quote or escape
+    bool word_expands = false;
+
+    auto end_word = [&](){
+        if(!in_word) return;
+        if(word_quoted && word_expands && w < r) buf[w++] = EXPAND_END;		// else one is in the word already
+        buf[w] = '\0';
+        Token tok{TokenKind::WORD, string_view(buf+word_start, w-word_start)};
+        tok.begin = word_start;
+        tok.end = r;
+        tok.expands = word_expands;
+        tok.quoted = word_quoted;
+        size_t eq = tok.text.substr(0, word_quoted ? unquoted_len : tok.text.size()).find('=');
+        tok.assignment = eq != string_view::npos && is_var_name(tok.text.substr(0, eq));
+        tokens.push_back(tok);
+        in_word = false;
+    };
+    auto mark_quoted = [&](){
+        if(!word_quoted) unquoted_len = w-word_start;
+        word_quoted = true;
+    };
+    // '$' at buf[r] starting a reference becomes a marker byte ($? keeps its '?' out of globbing)
+    size_t name_end = string::npos;		// write offset just past the last bare $NAME
+    auto copy_dollar = [&](size_t& r, char marker){
+        bool ref = r+1<len && starts_parameter(buf[r+1]);
+        buf[w++] = ref ? marker : '$';
+        word_expands |= ref;
+        r++;
+        if(ref && (buf[r]=='?' || buf[r]=='#' || isdigit(static_cast<unsigned char>(buf[r])))) buf[w++] = buf[r++];
+        // ${...} is copied whole so a special parameter inside (${?}) isn't taken for a glob
+        else if(ref && buf[r]=='{' && memchr(buf+r, '}', len-r)){
+            while(buf[r]!='}') buf[w++] = buf[r++];
+            buf[w++] = buf[r++];
+        }
+        else if(ref && (isalpha(static_cast<unsigned char>(buf[r])) || buf[r]=='_')){
+            while(r<len && (isalnum(static_cast<unsigned char>(buf[r])) || buf[r]=='_')) buf[w++] = buf[r++];
+            name_end = w;
+        }
+    };
+    /* Called right after a quote or backslash was dropped: if a bare
+       $NAME was written just before it, the following text must not
+       run into the name. The dropped byte leaves room for EXPAND_END. */
+    auto end_name = [&](){
+        if(w == name_end) buf[w++] = EXPAND_END;
+        name_end = string::npos;
+    };
+    // $(...) / `...` at buf[r]: marker, the command text, SUBST_END (an unterminated one is literal)
+    auto copy_substitution = [&](size_t& r, char marker){
+        bool backquoted = buf[r]=='`';
+        size_t start = backquoted ? r+1 : r+2;
+        size_t close = start;
+        if(backquoted){
+            while(close<len && buf[close]!='`') close += buf[close]=='\\' ? 2 : 1;
+        }
+        else close = find_substitution_end(buf, start, len);
+        if(close >= len){
+            buf[w++] = buf[r++];
+            return;
+        }
+        buf[w++] = marker;
+        for(size_t i=start; i<close; i++){
+            if(backquoted && buf[i]=='\\' && i+1<close && (buf[i+1]=='`' || buf[i+1]=='\\' || buf[i+1]=='$')) i++;
+            buf[w++] = buf[i];
+        }
+        buf[w++] = SUBST_END;
+        r = close+1;
+        word_expands = true;
+    };
+    // an n-character operator at buf[r]
+    auto push_operator = [&](TokenKind kind, size_t n){
+        end_word();
+        Token tok{kind, {}};
+        tok.begin = r;
+        tok.end = r+n;
+        tokens.push_back(tok);
+        r += n;
+    };
+
+    while(r<len){
+        char c = buf[r];
+        if(isspace(static_cast<unsigned char>(c))){
+            end_word();
+            r++;
+        }
+        else if(c=='#' && !in_word){
+            break;		// comment to end of line
+        }
+        else if(c=='|'){
+            bool doubled = r+1<len && buf[r+1]=='|';
+            push_operator(doubled ? TokenKind::OR : TokenKind::PIPE, doubled ? 2 : 1);
+        }
+        else if(c=='&'){
+            bool doubled = r+1<len && buf[r+1]=='&';
+            push_operator(doubled ? TokenKind::AND : TokenKind::AMP, doubled ? 2 : 1);
+        }
+        else if(c==';' || c=='(' || c==')'){
+            push_operator(c==';' ? TokenKind::SEMI : c=='(' ? TokenKind::LPAREN : TokenKind::RPAREN, 1);
+        }
+        else if(c=='>'){
+            bool append = r+1<len && buf[r+1]=='>';
+            int fd = 1;
+            // "1>" / "2>": a lone unquoted digit glued to the operator names the fd
+            if(in_word && !word_quoted && w-word_start==1 && (buf[word_start]=='1' || buf[word_start]=='2')){
+                fd = buf[word_start]-'0';
+                in_word = false;
+            }
+            else end_word();
+            Token tok{TokenKind::REDIRECT, {}, fd, append ? RedirectOp::APPEND : RedirectOp::WRITE};
+            tok.begin = r;
+            tok.end = r+(append ? 2 : 1);
+            tokens.push_back(tok);
+            r = tok.end;
+        }
+        else if(c=='<'){
+            // "0<": a lone unquoted 0 glued to the operator
+            if(in_word && !word_quoted && w-word_start==1 && buf[word_start]=='0') in_word = false;
+            else end_word();
+            Token tok{TokenKind::REDIRECT, {}, 0, RedirectOp::READ};
+            size_t n = 1;
+            if(r+2<len && buf[r+1]=='<' && buf[r+2]=='<'){
+                tok.op = RedirectOp::HERESTRING;
+                n = 3;
+            }
+            else if(r+1<len && buf[r+1]=='<'){
+                bool strip = r+2<len && buf[r+2]=='-';
+                tok.op = strip ? RedirectOp::HEREDOC_STRIP : RedirectOp::HEREDOC;
+                n = strip ? 3 : 2;
+            }
+            tok.begin = r;
+            tok.end = r+n;
+            tokens.push_back(tok);
+            r = tok.end;
+        }
+        else{
+            if(!in_word){
+                in_word = true;
+                word_quoted = false;
+                word_expands = false;
+                word_start = w = r;
+            }
+            if(c=='\''){
+                mark_quoted();
+                r++;
+                end_name();
+                while(r<len && buf[r]!='\'') buf[w++] = buf[r++];
+                if(r<len) r++;
+            }
+            else if(c=='"'){
+                mark_quoted();
+                r++;
+                end_name();
+                while(r<len && buf[r]!='"'){
+                    if(buf[r]=='\\' && r+1<len && (buf[r+1]=='"' || buf[r+1]=='\\' || buf[r+1]=='$' || buf[r+1]=='`')){
+                        r++;
+                        end_name();
+                    }
+                    else if(starts_substitution(buf, r, len)){
+                        copy_substitution(r, SUBST_QUOTED);
+                        continue;
+                    }
+                    else if(buf[r]=='$'){
+                        copy_dollar(r, EXPAND_QUOTED);
+                        continue;
+                    }
+                    buf[w++] = buf[r++];
+                }
+                if(r<len){
+                    r++;
+                    end_name();
+                }
+            }
+            else if(c=='\\' && r+1<len){
+                mark_quoted();
+                r++;
+                end_name();
+                buf[w++] = buf[r++];
+            }
+            else if(starts_substitution(buf, r, len)){
+                copy_substitution(r, SUBST_UNQUOTED);
+            }
+            else if(c=='$'){
+                copy_dollar(r, EXPAND_UNQUOTED);
+            }
+            else if(c=='*' || c=='?' || c=='['){
+                buf[w++] = c=='*' ? GLOB_STAR : c=='?' ? GLOB_ONE : GLOB_CLASS;
+                word_expands = true;
+                r++;
+            }
+            else{
+                buf[w++] = c;
+                r++;
+            }
+        }
+    }
+    end_word();
+}
+
+// Helper: Text of a token for syntax error messages
+string token_name(const Token* tok){
+    if(!tok) return "newline";
+    if(tok->kind == TokenKind::PIPE) return "|";
+    if(tok->kind == TokenKind::AMP) return "&";
+    if(tok->kind == TokenKind::AND) return "&&";
+    if(tok->kind == TokenKind::OR) return "||";
+    if(tok->kind == TokenKind::SEMI) return ";";
+    if(tok->kind == TokenKind::LPAREN) return "(";
+    if(tok->kind == TokenKind::RPAREN) return ")";
+    if(tok->kind == TokenKind::REDIRECT){
+        static const char* const ops[] = {">", ">>", "<", "<<", "<<-", "<<<"};
+        return string(tok->fd==2 ? "2" : "")+ops[static_cast<int>(tok->op)];
+    }
+    return string(tok->text);
+}
+
+/* Recursive-descent parser over the token list:
+
+       list     := and_or ((; | &) and_or)* [; | &]
+       and_or   := pipeline ((&& | ||) pipeline)*
+       pipeline := [time] stage (| stage)*
+       stage    := ( list ) redirection*
+                 | (NAME=value)* (word | redirection)*
+
+   A ( list ) body is stored in CommandLine::lists and referred to by
+   index, since nested bodies are appended while the outer ones are
+   still being filled in. */
+class Parser {
+public:
+    Parser(CommandLine& line, const string& input) : line(line), input(input), toks(line.tokens) {}
+
+    void parse(){
+        line.lists.emplace_back();
+        parse_list(0, false);
+        if(line.error.empty() && pos < toks.size()) fail();
+    }
+
+private:
+    CommandLine& line;
+    const string& input;
+    const vector<Token>& toks;
+    size_t pos = 0;
+
+    const Token* peek() const { return pos < toks.size() ? &toks[pos] : nullptr; }
+
+    bool at(TokenKind kind) const { return pos < toks.size() && toks[pos].kind == kind; }
+
+    bool at_word() const { return at(TokenKind::WORD) || at(TokenKind::REDIRECT); }
+
+    // syntax error at the current token (first one wins)
+    void fail(){
+        if(line.error.empty()) line.error = "syntax error near unexpected token `"+token_name(peek())+"'";
+    }
+
+    // Source text of tokens [first, pos)
+    string text_from(size_t first) const {
+        if(first >= pos) return "";
+        return input.substr(toks[first].begin, toks[pos-1].end-toks[first].begin);
+    }
+
+    void parse_list(size_t index, bool in_paren){
+        while(line.error.empty() && pos < toks.size()){
+            if(in_paren && at(TokenKind::RPAREN)) break;
+            size_t first = pos;
+            AndOr item;
+            parse_and_or(item);
+            if(!line.error.empty()) return;
+            item.text = text_from(first);
+            if(at(TokenKind::AMP)){
+                item.background = true;
+                item.text += " &";
+                pos++;
+            }
+            else if(at(TokenKind::SEMI)) pos++;
+            else if(pos < toks.size() && !(in_paren && at(TokenKind::RPAREN))){
+                fail();
+                return;
+            }
+            line.lists[index].items.push_back(std::move(item));
+        }
+    }
+
+    void parse_and_or(AndOr& item){
+        item.pipelines.emplace_back();
+        parse_pipeline(item.pipelines.back());
+        while(line.error.empty() && (at(TokenKind::AND) || at(TokenKind::OR))){
+            item.and_ops.push_back(at(TokenKind::AND));
+            pos++;
+            item.pipelines.emplace_back();
+            parse_pipeline(item.pipelines.back());
+        }
+    }
+
+    void parse_pipeline(Pipeline& pipeline){
+        size_t first = pos;
+        // time keyword: times the whole pipeline that follows
+        if(at(TokenKind::WORD) && toks[pos].text == "time"){
+            pipeline.timed = true;
+            pos++;
+            // time alone times nothing
+            if(!at_word() && !at(TokenKind::LPAREN) && !at(TokenKind::PIPE)){
+                pipeline.stages.emplace_back();
+                pipeline.text = text_from(first);
+                return;
+            }
+        }
+        size_t pipes = 0;
+        for(size_t k=pos; k<toks.size() && toks[k].kind != TokenKind::SEMI; k++) pipes += toks[k].kind == TokenKind::PIPE;
+        pipeline.stages.reserve(pipes+1);
+        while(true){
+            pipeline.stages.emplace_back();
+            parse_stage(pipeline.stages.back());
+            if(!line.error.empty() || !at(TokenKind::PIPE)) break;
+            pos++;
+        }
+        pipeline.text = text_from(first);
+    }
+
+    void parse_stage(Stage& stage){
+        if(at(TokenKind::LPAREN)){
+            pos++;
+            stage.subshell = line.lists.size();
+            line.lists.emplace_back();
+            parse_list(stage.subshell, true);
+            if(!line.error.empty()) return;
+            if(!at(TokenKind::RPAREN) || line.lists[stage.subshell].items.empty()){
+                fail();
+                return;
+            }
+            pos++;
+            // only redirections may follow the closing )
+            while(line.error.empty() && at(TokenKind::REDIRECT)) parse_redirection(stage);
+            if(at(TokenKind::WORD) || at(TokenKind::LPAREN)) fail();
+            return;
+        }
+        size_t first = pos;
+        while(line.error.empty() && at_word()){
+            if(at(TokenKind::REDIRECT)){
+                parse_redirection(stage);
+                continue;
+            }
+            const Token& tok = toks[pos++];
+            line.expands |= tok.expands;
+            // NAME=value words before the command name are assignments
+            if(tok.assignment && stage.argv.empty()) stage.assigns.push_back(tok.text);
+            else stage.argv.push_back(tok.text);
+        }
+        if(line.error.empty() && (pos == first || at(TokenKind::LPAREN))) fail();
+    }
+
+    void parse_redirection(Stage& stage){
+        const Token& tok = toks[pos++];
+        if(!at(TokenKind::WORD)){
+            fail();
+            return;
+        }
+        const Token& target = toks[pos++];
+        Redirection redir{tok.fd, tok.op, target.text};
+        if(tok.op == RedirectOp::HEREDOC || tok.op == RedirectOp::HEREDOC_STRIP){
+            // the delimiter is matched literally: quotes removed, nothing expanded
+            HereDoc doc;
+            for(char c : target.text){
+                if(c != EXPAND_END) doc.delimiter += (c==EXPAND_UNQUOTED || c==EXPAND_QUOTED) ? '$' : glob_literal_char(c);
+            }
+            doc.strip_tabs = tok.op == RedirectOp::HEREDOC_STRIP;
+            doc.expand = !target.quoted;
+            redir.heredoc = line.heredocs.size();
+            line.heredocs.push_back(std::move(doc));
+        }
+        else line.expands |= target.expands;
+        stage.redirs.push_back(redir);
+    }
+};
+
+/* Helper:
+		Lexes and parses one input line into its command lists, and-or
+		chains and pipeline stages. Allocations are bounded by the
+		token/stage counts: one arena, one token array, one argv/
+		redirection list per stage. */
+CommandLine parse_line(const string& input){
+    TRACE_SPAN("parse");
+    CommandLine line;
+    size_t len = input.size();
+    line.arena.reset(new char[len+1]);
+    memcpy(line.arena.get(), input.data(), len);
+    line.arena[len] = '\0';
+
+    // The lexer marks expansions with control bytes; typed ones would be taken for markers
+    auto reserved = find_if(input.begin(), input.end(), [](char c){ return (c >= '\x01' && c <= SUBST_END) || c == EXPAND_END; });
+    if(reserved != input.end()){
+        char hex[8];
+        snprintf(hex, sizeof hex, "\\x%02x", *reserved);
+        line.error = string("syntax error: control character ")+hex+" in input";
+        return line;
+    }
+
+    line.tokens.reserve(16);
+    lex_line(line.arena.get(), len, line.tokens);
+    Parser(line, input).parse();
+    return line;
+}
+
+/* Where here-document bodies come from: the rest of the script, -c
+   string or terminal input the current line was read from. Unset (as
+   in a pool session's single line), a here-document is empty. */
+static function<bool(string&)> next_input_line;
+
+// Helper: Reads the bodies of a freshly parsed line's here-documents, in order
+void read_heredoc_bodies(CommandLine& line){
+    for(auto& doc : line.heredocs){
+        string text;
+        bool closed = false;
+        while(next_input_line && next_input_line(text)){
+            size_t start = 0;
+            if(doc.strip_tabs) while(start < text.size() && text[start]=='\t') start++;
+            if(text.compare(start, string::npos, doc.delimiter) == 0){
+                closed = true;
+                break;
+            }
+            doc.body.append(text, start, string::npos);
+            doc.body += '\n';
+        }
+        if(!closed) cerr<<"warning: here-document delimited by end-of-file (wanted `"<<doc.delimiter<<"')\n";
+    }
+}
+
+/* Parsed-line cache: interactive sessions, scripts with loops over the
+   same commands and $(...) in repeated lines parse identical text over
+   and over. Parsed lines are immutable, so they are shared through
+   shared_ptr; an entry evicted while still running stays alive until
+   it finishes. Least recently used entries go first. */
+const size_t PARSE_CACHE_SIZE = 256;
+static list<pair<string, shared_ptr<const CommandLine>>> parse_cache;		// most recent first
+static unordered_map<string_view, decltype(parse_cache)::iterator> parse_cache_index;
+
+// Helper: parse_line through the cache
+shared_ptr<const CommandLine> parse_cached(const string& input){
+    auto it = parse_cache_index.find(input);
+    if(it != parse_cache_index.end()){
+        parse_cache.splice(parse_cache.begin(), parse_cache, it->second);
+        return it->second->second;
+    }
+    auto parsed = make_shared<CommandLine>(parse_line(input));
+    // here-document bodies are the lines that follow, different each time
+    if(parsed->error.empty() && !parsed->heredocs.empty()){
+        read_heredoc_bodies(*parsed);
+        return parsed;
+    }
+    shared_ptr<const CommandLine> line = parsed;
+    if(input.size() > 4096) return line;		// pasted scripts: not worth keeping
+    if(parse_cache.size() >= PARSE_CACHE_SIZE){
+        parse_cache_index.erase(parse_cache.back().first);
+        parse_cache.pop_back();
+    }
+    parse_cache.emplace_front(input, line);
+    parse_cache_index[parse_cache.front().first] = parse_cache.begin();
+    return line;
+}
+
+// ------------------------------------------------------------
+// Parameter expansion ($NAME, ${NAME}, $?, $#, $0, $$, $!) and command substitution
+// ------------------------------------------------------------
+/* Expansion runs each time a line executes, on a copy of its stages,
+   so the parsed line itself stays reusable. Words without markers are
+   passed through as-is. */
+
+/* Helper:
+		Value of the reference whose marker is at text[pos]. Returns
+		the length of the reference, or 0 if it is not one (the '$'
+		is then literal, e.g. an unterminated ${). */
+size_t parameter_value(string_view text, size_t pos, string& value){
+    size_t i = pos+1;
+    string_view name;
+    if(i < text.size() && text[i]=='{'){
+        size_t close = text.find('}', i+1);
+        if(close == string_view::npos) return 0;
+        name = text.substr(i+1, close-i-1);
+        i = close+1;
+    }
+    else if(i < text.size() && (text[i]=='?' || text[i]=='#' || text[i]=='$' || text[i]=='!' || isdigit(static_cast<unsigned char>(text[i])))){
+        name = text.substr(i++, 1);
+    }
+    else{
+        size_t start = i;
+        while(i < text.size() && (isalnum(static_cast<unsigned char>(text[i])) || text[i]=='_')) i++;
+        name = text.substr(start, i-start);
+    }
+
+    if(name == "?") value = to_string(last_status);
+    else if(name == "$") value = to_string(getpid());
+    else if(name == "!") value = last_background_pid > 0 ? to_string(last_background_pid) : "";
+    else if(name == "#") value = "0";
+    else if(name == "0") value = shell_name;
+    else if(!name.empty() && all_of(name.begin(), name.end(), [](char c){ return isdigit(static_cast<unsigned char>(c)); })) value.clear();
+    else if(is_var_name(name)) value = var_value(name);
+    else return 0;
+    return i-pos;
+}
+
+string command_output(const string& text);
+
+/* Helper:
+		Expands one word into fields. With split, the values of unquoted
+		references are split on blanks and a word that expands to nothing
+		unquoted disappears; without it the result is always one field.
+		Glob characters in split values become markers, as if typed. */
+void expand_word(string_view word, bool split, vector<string>& fields){
+    string current;
+    bool have_field = !split;	// an empty quoted reference still makes a field
+    string value;
+    for(size_t i=0; i<word.size(); ){
+        char c = word[i];
+        size_t len = 0;
+        if(c == EXPAND_END){
+            have_field = true;
+            i++;
+            continue;
+        }
+        if(c==EXPAND_UNQUOTED || c==EXPAND_QUOTED) len = parameter_value(word, i, value);
+        else if(c==SUBST_UNQUOTED || c==SUBST_QUOTED){
+            len = word.find(SUBST_END, i)+1-i;
+            value = command_output(string(word.substr(i+1, len-2)));
+        }
+        if(len == 0){
+            current += (c==EXPAND_UNQUOTED || c==EXPAND_QUOTED) ? '$' : c;
+            have_field = true;
+            i++;
+            continue;
+        }
+        i += len;
+        if(c==EXPAND_QUOTED || c==SUBST_QUOTED || !split){
+            current += value;
+            have_field = true;
+            continue;
+        }
+        for(char v : value){
+            if(!isspace(static_cast<unsigned char>(v))){
+                current += v=='*' ? GLOB_STAR : v=='?' ? GLOB_ONE : v=='[' ? GLOB_CLASS : v;
+                have_field = true;
+            }
+            else if(have_field){
+                fields.push_back(std::move(current));
+                current.clear();
+                have_field = false;
+            }
+        }
+    }
+    if(have_field) fields.push_back(std::move(current));
+}
+
+// ------------------------------------------------------------
+// Pathname expansion (*, ?, [...], **)
+// ------------------------------------------------------------
+/* Unquoted glob characters reach this point as marker bytes, so a
+   quoted '*' is never a pattern. Directory listings are read once per
+   pipeline with getdents64 and shared by every pattern in it; a **
+   component walks the tree below it on several threads. Matches are
+   sorted by byte value (the POSIX locale's collation order). */
+struct DirEntry {
+    string name;
+    unsigned char type;		// DT_* from the listing (DT_UNKNOWN on some filesystems)
+};
+using DirListing = shared_ptr<const vector<DirEntry>>;
+
+static unordered_map<string, DirListing> dir_cache;	// directory -> listing, for the current pipeline
+static mutex dir_cache_mutex;						// ** walks list directories on threads
+
+#ifdef __linux__
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// Helper: Forgets the cached listings (before each pipeline is expanded)
+void clear_dir_cache(){
+    lock_guard<mutex> lock(dir_cache_mutex);
+    dir_cache.clear();
+}
+
+// Helper: Entries of a directory without . and .., read at most once per pipeline
+DirListing list_directory(const string& dir){
+    {
+        lock_guard<mutex> lock(dir_cache_mutex);
+        auto it = dir_cache.find(dir);
+        if(it != dir_cache.end()) return it->second;
+    }
+    TRACE_SPAN("list_directory", dir);
+    auto entries = make_shared<vector<DirEntry>>();
+    auto add = [&](const char* name, unsigned char type){
+        if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) return;
+        entries->push_back({name, type});
+    };
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd >= 0){
+#ifdef __linux__
+        alignas(LinuxDirent64) char buf[32768];
+        long nread;
+        while((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+            for(long off = 0; off < nread; ){
+                auto* d = reinterpret_cast<LinuxDirent64*>(buf+off);
+                add(d->d_name, d->d_type);
+                off += d->d_reclen;
+            }
+        }
+        close(fd);
+#else
+        if(DIR* d = fdopendir(fd)){
+            while(struct dirent* e = readdir(d)) add(e->d_name, e->d_type);
+            closedir(d);
+        }
+        else close(fd);
+#endif
+    }
+    lock_guard<mutex> lock(dir_cache_mutex);
+    return dir_cache.emplace(dir, std::move(entries)).first->second;
+}
+
+// Helper: dir/name, where "" is the current directory
+string join_path(const string& dir, const string& name){
+    if(dir.empty()) return name;
+    return dir.back() == '/' ? dir+name : dir+"/"+name;
+}
+
+// Helper: Checks whether an entry is a directory; symlinks count only when follow is set
+bool entry_is_dir(const string& dir, const DirEntry& e, bool follow){
+    if(e.type == DT_DIR) return true;
+    if(e.type != DT_UNKNOWN && (e.type != DT_LNK || !follow)) return false;
+    struct stat st;
+    string path = join_path(dir, e.name);
+    return (follow ? stat(path.c_str(), &st) : lstat(path.c_str(), &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Helper:
+		Matches c against the bracket expression starting at pat[p]
+		('[', then an optional ! or ^, ranges like a-z). Sets len to
+		the expression's length; returns false in len==0 when there
+		is no closing ']', in which case the '[' is an ordinary char. */
+bool match_class(string_view pat, size_t p, char c, size_t& len){
+    len = 0;
+    size_t i = p+1;
+    bool negate = i < pat.size() && (pat[i] == '!' || pat[i] == '^');
+    if(negate) i++;
+    bool matched = false;
+    for(bool first = true; i < pat.size(); first = false){
+        char lo = glob_literal_char(pat[i]);
+        if(lo == ']' && !first){
+            len = i+1-p;
+            return matched != negate;
+        }
+        if(i+2 < pat.size() && pat[i+1] == '-' && pat[i+2] != ']'){
+            char hi = glob_literal_char(pat[i+2]);
+            if(static_cast<unsigned char>(c) >= static_cast<unsigned char>(lo) && static_cast<unsigned char>(c) <= static_cast<unsigned char>(hi)) matched = true;
+            i += 3;
+        }
+        else{
+            if(c == lo) matched = true;
+            i++;
+        }
+    }
+    return false;
+}
+
+// Helper: Matches one path component against a pattern (with markers); backtracks over the last *
+bool glob_match(string_view pat, string_view name){
+    size_t p = 0, n = 0;
+    size_t star_p = string_view::npos, star_n = 0;
+    while(n < name.size()){
+        if(p < pat.size()){
+            char c = pat[p];
+            size_t len = 0;
+            if(c == GLOB_STAR){
+                star_p = ++p;
+                star_n = n;
+                continue;
+            }
+            if(c == GLOB_ONE){
+                p++;
+                n++;
+                continue;
+            }
+            if(c == GLOB_CLASS){
+                bool matched = match_class(pat, p, name[n], len);
+                if(len == 0 ? name[n] == '[' : matched){
+                    p += len ? len : 1;
+                    n++;
+                    continue;
+                }
+            }
+            else if(c == name[n]){
+                p++;
+                n++;
+                continue;
+            }
+        }
+        if(star_p == string_view::npos) return false;
+        p = star_p;
+        n = ++star_n;
+    }
+    while(p < pat.size() && pat[p] == GLOB_STAR) p++;
+    return p == pat.size();
+}
+
+// Helper: Checks whether a word (or component) has a * ? or a closed [...] to expand
+bool is_glob_pattern(string_view word){
+    for(size_t i=0; i<word.size(); i++){
+        size_t len;
+        if(word[i] == GLOB_STAR || word[i] == GLOB_ONE) return true;
+        if(word[i] == GLOB_CLASS){
+            match_class(word, i, '\0', len);
+            if(len) return true;
+        }
+    }
+    return false;
+}
+
+// Helper: A word with its glob markers turned back into the characters they stand for
+string glob_literal(string_view word){
+    string text(word);
+    for(char& c : text) c = glob_literal_char(c);
+    return text;
+}
+
+/* Helper:
+		Every directory (and, with files, every other entry) below root,
+		hidden ones excepted, without following symlinks. Directories
+		are listed by a small pool of threads sharing one queue. */
+vector<string> walk_tree(const string& root, bool files){
+    mutex m;
+    condition_variable cv;
+    deque<string> queue{root};
+    int busy = 0;
+    vector<string> found;
+
+    auto work = [&](){
+        unique_lock<mutex> lock(m);
+        for(;;){
+            cv.wait(lock, [&](){ return !queue.empty() || busy == 0; });
+            if(queue.empty()) return;		// nothing queued and nobody listing: done
+            string dir = std::move(queue.front());
+            queue.pop_front();
+            busy++;
+            lock.unlock();
+
+            DirListing entries = list_directory(dir);
+            vector<string> subdirs, others;
+            for(const auto& e : *entries){
+                if(e.name[0] == '.') continue;
+                (entry_is_dir(dir, e, false) ? subdirs : others).push_back(join_path(dir, e.name));
+            }
+
+            lock.lock();
+            for(auto& s : subdirs){
+                found.push_back(s);
+                queue.push_back(std::move(s));
+            }
+            if(files) found.insert(found.end(), others.begin(), others.end());
+            busy--;
+            cv.notify_all();
+        }
+    };
+
+    unsigned helpers = min(max(thread::hardware_concurrency(), 1u), 8u)-1;
+    vector<thread> threads;
+    for(unsigned i=0; i<helpers; i++) threads.emplace_back(work);
+    work();
+    for(auto& t : threads) t.join();
+    return found;
+}
+
+// Helper: Matches components[idx...] below dir, appending full paths to out
+void glob_walk(const string& dir, const vector<string>& components, size_t idx, vector<string>& out){
+    const string& comp = components[idx];
+    bool last = idx+1 == components.size();
+
+    // a literal component is only checked for existence at the end
+    if(!is_glob_pattern(comp)){
+        string path = join_path(dir, glob_literal(comp));
+        struct stat st;
+        if(!last) glob_walk(path, components, idx+1, out);
+        else if(lstat(path.c_str(), &st) == 0) out.push_back(path);
+        return;
+    }
+
+    // **: any number of directories (as the last component: everything below)
+    if(comp.size() == 2 && comp[0] == GLOB_STAR && comp[1] == GLOB_STAR){
+        vector<string> below = walk_tree(dir, last);
+        if(last){
+            if(!dir.empty()) out.push_back(join_path(dir, ""));	// "a/**" lists "a/" too
+            out.insert(out.end(), below.begin(), below.end());
+            return;
+        }
+        glob_walk(dir, components, idx+1, out);
+        for(const auto& d : below) glob_walk(d, components, idx+1, out);
+        return;
+    }
+
+    bool hidden_ok = comp[0] == '.';		// leading dots must be matched literally
+    for(const auto& e : *list_directory(dir)){
+        if(e.name[0] == '.' && !hidden_ok) continue;
+        if(!glob_match(comp, e.name)) continue;
+        if(last) out.push_back(join_path(dir, e.name));
+        else if(entry_is_dir(dir, e, true)) glob_walk(join_path(dir, e.name), components, idx+1, out);
+    }
+}
+
+/* Helper:
+		Expands a pattern into the sorted paths it matches; false (out
+		untouched) when nothing matches, so the caller keeps the word. */
+bool glob_expand(string_view pattern, vector<string>& out){
+    TRACE_SPAN("glob");
+    string dir;
+    if(pattern[0] == '/') dir = "/";
+    bool dirs_only = pattern.back() == '/';
+    vector<string> components;
+    for(size_t start = 0; start < pattern.size(); ){
+        size_t end = pattern.find('/', start);
+        if(end == string_view::npos) end = pattern.size();
+        if(end > start) components.emplace_back(pattern.substr(start, end-start));
+        start = end+1;
+    }
+    if(components.empty()) return false;
+    if(dirs_only) components.emplace_back(".");	// "pat/" matches directories only
+
+    vector<string> matches;
+    glob_walk(dir, components, 0, matches);
+    if(matches.empty()) return false;
+    if(dirs_only) for(auto& m : matches) m.pop_back();		// "x/." -> "x/"
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+    for(auto& m : matches) out.push_back(std::move(m));
+    return true;
+}
+
+// Helper: Checks whether a word holds expansion markers
+bool has_expansions(string_view word){
+    return word.find_first_of(EXPANSION_MARKERS) != string_view::npos;
+}
+
+/* Helper:
+		Expanded copy of a stage. New words are kept in storage (a deque,
+		so they never move and stay NUL-terminated for exec). Redirection
+		targets, assignment values and export's NAME=value arguments are
+		neither field-split nor globbed. A pattern matching nothing is
+		passed on as typed. */
+Stage expand_stage(const Stage& stage, deque<string>& storage){
+    Stage out;
+    out.subshell = stage.subshell;
+    vector<string> fields, matches;
+    auto expand = [&](string_view word, bool split, vector<string_view>& dest){
+        if(!has_expansions(word)){
+            dest.push_back(word);
+            return;
+        }
+        fields.clear();
+        expand_word(word, split, fields);
+        for(auto& f : fields){
+            matches.clear();
+            if(split && is_glob_pattern(f) && glob_expand(f, matches)){
+                for(auto& m : matches){
+                    storage.push_back(std::move(m));
+                    dest.push_back(storage.back());
+                }
+                continue;
+            }
+            storage.push_back(glob_literal(f));
+            dest.push_back(storage.back());
+        }
+    };
+
+    out.argv.reserve(stage.argv.size());
+    for(auto word : stage.argv){
+        bool declaration = !out.argv.empty() && out.argv[0]=="export" && word.find('=') < word.find_first_of(EXPANSION_MARKERS);
+        expand(word, !declaration, out.argv);
+    }
+    for(auto word : stage.assigns) expand(word, false, out.assigns);
+    vector<string_view> target;
+    for(auto r : stage.redirs){
+        if(r.heredoc < 0){
+            target.clear();
+            expand(r.target, false, target);
+            r.target = target[0];
+        }
+        out.redirs.push_back(r);
+    }
+    return out;
+}
+
+// Helper: Applies NAME=value words to the shell's variables
+void assign_variables(const vector<string_view>& assigns){
+    for(auto a : assigns){
+        size_t eq = a.find('=');
+        variables.set(a.substr(0, eq), a.substr(eq+1));
+    }
+}
+
+/* Helper:
+		NAME=value prefixes of a builtin: exported for the duration of
+		the call. Returns the variables they replace (nullopt: unset),
+		for restore_variables() afterwards. */
+vector<pair<string, optional<VariableTable::Var>>> assign_temporarily(const vector<string_view>& assigns){
+    vector<pair<string, optional<VariableTable::Var>>> saved;
+    for(auto a : assigns){
+        string_view name = a.substr(0, a.find('='));
+        const VariableTable::Var* var = variables.find(name);
+        saved.emplace_back(string(name), var ? optional<VariableTable::Var>(*var) : nullopt);
+        variables.set(name, a.substr(name.size()+1), true);
+    }
+    return saved;
+}
+
+void restore_variables(const vector<pair<string, optional<VariableTable::Var>>>& saved){
+    for(auto it = saved.rbegin(); it != saved.rend(); ++it){
+        variables.erase(it->first);
+        if(it->second) variables.set(it->first, it->second->value, it->second->exported);
+    }
+}
+
+// Helper: The exported environment with a command's NAME=value prefix assignments applied
+vector<string> command_environment(const vector<string_view>& assigns){
+    vector<string> env;
+    for(char** e = shell_envp(); *e; e++){
+        string_view entry = *e;
+        string_view name = entry.substr(0, entry.find('='));
+        bool overridden = any_of(assigns.begin(), assigns.end(), [&](string_view a){ return a.substr(0, a.find('=')) == name; });
+        if(!overridden) env.emplace_back(entry);
+    }
+    for(auto a : assigns) env.emplace_back(a);
+    return env;
+}
+
+// Helper: Builtin commands allowed for completion
+vector<string> builtins = {"echo", "exit", "history"};
+
+// Helper: Longest Common Prefix
+string longest_common_prefix(const vector<string>& strs){
+    if (strs.empty()) return "";
+
+    string prefix = strs[0];
+    for(size_t i=1; i<strs.size(); i++){
+        size_t j = 0;
+        while(j<prefix.size() && j<strs[i].size() && prefix[j]==strs[i][j]){
+            j++;
+        }
+        prefix = prefix.substr(0, j);
+        if(prefix.empty()) break;
+    }
+    return prefix;
+}
+
+// ------------------------------------------------------------
+// Executable index for tab completion
+// ------------------------------------------------------------
+struct IndexedDir {
+    string path;
+    unordered_set<string> names;
+    int wd = -1;		// inotify watch descriptor
+    time_t mtime = 0;	// change detection where inotify is unavailable
+};
+static map<string, int> exec_index;	// name -> number of PATH dirs providing it
+static vector<IndexedDir> indexed_dirs;
+static string indexed_path_env;
+static int inotify_fd = -1;
+static thread* index_builder = nullptr;	// never destroyed: forked children exit() freely
+
+// Helper: Checks whether a directory entry is an executable regular file
+bool is_executable_entry(int dir_fd, const char* name){
+    struct stat st;
+    if(fstatat(dir_fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode)) return false;
+    return (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+}
+
+// Helper: Adds/removes one name of one directory, keeping exec_index in sync
+void index_add(IndexedDir& dir, const string& name){
+    if(dir.names.insert(name).second) exec_index[name]++;
+}
+
+void index_remove(IndexedDir& dir, const string& name){
+    if(dir.names.erase(name) == 0) return;
+    auto it = exec_index.find(name);
+    if(it != exec_index.end() && --it->second == 0) exec_index.erase(it);
+}
+
+// Helper: (Re)reads every executable in one indexed directory
+void index_scan_dir(IndexedDir& dir){
+    for(auto it = dir.names.begin(); it != dir.names.end(); ){
+        string name = *it++;
+        index_remove(dir, name);
+    }
+    DIR* d = opendir(dir.path.c_str());
+    if(!d) return;
+    struct stat st;
+    if(fstat(dirfd(d), &st) == 0) dir.mtime = st.st_mtime;
+    while(struct dirent* e = readdir(d)){
+        if(e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2]))) continue;
+        if(e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN) continue;
+        if(is_executable_entry(dirfd(d), e->d_name)) index_add(dir, e->d_name);
+    }
+    closedir(d);
+}
+
+/* Helper:
+		Builds the index from scratch for the current PATH. On Linux
+		every directory is watched with inotify before it is scanned,
+		so nothing created during the scan is missed. */
+void build_exec_index(const string& path_env){
+    TRACE_SPAN("build_exec_index");
+    exec_index.clear();
+    indexed_dirs.clear();
+    indexed_path_env = path_env;
+#ifdef __linux__
+    if(inotify_fd >= 0) close(inotify_fd);
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    unordered_set<string> seen;
+    for(const auto& dir : split_path(path_env)){
+        string path = dir.empty() ? "." : dir;
+        if(!seen.insert(path).second) continue;
+        IndexedDir entry;
+        entry.path = path;
+#ifdef __linux__
+        if(inotify_fd >= 0){
+            entry.wd = inotify_add_watch(inotify_fd, path.c_str(),
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        }
+#endif
+        indexed_dirs.push_back(std::move(entry));
+    }
+    for(auto& dir : indexed_dirs) index_scan_dir(dir);
+}
+
+// Helper: Kicks off the initial index build in the background
+void start_exec_index(){
+    string path = var_value("PATH");
+    index_builder = new thread(build_exec_index, path);
+}
+
+// Helper: Blocks until the background build (if any) has finished
+void wait_exec_index(){
+    if(!index_builder) return;
+    index_builder->join();
+    delete index_builder;
+    index_builder = nullptr;
+}
+
+/* Helper:
+		Applies filesystem changes since the last call. Watched
+		directories are updated from queued inotify events, touching
+		only the names that changed; elsewhere directories whose
+		mtime moved are rescanned. */
+void refresh_exec_index(){
+    wait_exec_index();
+
+    string path = var_value("PATH");
+    if(path != indexed_path_env){
+        build_exec_index(path);
+        return;
+    }
+
+#ifdef __linux__
+    if(inotify_fd >= 0){
+        alignas(struct inotify_event) char buf[16384];
+        ssize_t len;
+        while((len = read(inotify_fd, buf, sizeof(buf))) > 0){
+            for(char* p = buf; p < buf+len; ){
+                auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event)+ev->len;
+                if(ev->mask & IN_Q_OVERFLOW){
+                    build_exec_index(path);
+                    return;
+                }
+                auto dir = find_if(indexed_dirs.begin(), indexed_dirs.end(),
+                    [&](const IndexedDir& d){ return d.wd == ev->wd; });
+                if(dir == indexed_dirs.end()) continue;
+                if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)){
+                    index_scan_dir(*dir);
+                    continue;
+                }
+                if(ev->len == 0) continue;
+                string name = ev->name;
+                // A change anywhere on PATH may shadow or remove the hashed location
+                {
+                    lock_guard<recursive_mutex> lock(command_hash_mutex);
+                    command_hash.erase(name);
+                }
+                int fd = open(dir->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                bool exec = fd >= 0 && is_executable_entry(fd, name.c_str());
+                if(fd >= 0) close(fd);
+                if(exec) index_add(*dir, name);
+                else index_remove(*dir, name);
+            }
+        }
+        return;
+    }
+#endif
+    for(auto& dir : indexed_dirs){
+        struct stat st;
+        if(stat(dir.path.c_str(), &st) == 0 && st.st_mtime != dir.mtime){
+            index_scan_dir(dir);
+        }
+    }
+}
+
+// Helper: Sorted, de-duplicated executables starting with prefix
+vector<string> exec_index_lookup(const string& prefix){
+    vector<string> matches;
+    for(auto it = exec_index.lower_bound(prefix); it != exec_index.end(); ++it){
+        if(it->first.compare(0, prefix.size(), prefix) != 0) break;
+        matches.push_back(it->first);
+    }
+    return matches;
+}
+
+// ------------------------------------------------------------
+// Tab auto-completion
+// ------------------------------------------------------------
+int handle_tab(int, int) {
+    TRACE_SPAN("complete");
+    static string last_buffer;
+    static bool tab_pressed_before = false;
+
+    string buffer = rl_line_buffer;
+
+    // Only complete first word
+    if(buffer.find(' ') != string::npos){
+        cout<<"\a"<<flush;
+        tab_pressed_before = false;
+        return 0;
+    }
+
+    // Reset TAB state if buffer changed
+    if(buffer != last_buffer){
+        tab_pressed_before = false;
+        last_buffer = buffer;
+    }
+
+    //---------------- BUILTINS FIRST ---------------- 
+    vector<string> builtin_matches;
+
+    for(const auto& b : builtins){
+        if(b.rfind(buffer, 0)==0){
+            builtin_matches.push_back(b);
+        }
+    }
+
+    if(builtin_matches.size() == 1){
+        string suffix = builtin_matches[0].substr(buffer.size());
+        rl_insert_text(suffix.c_str());
+        rl_insert_text(" ");
+        rl_redisplay();
+        tab_pressed_before = false;
+        return 0;
+    }
+
+    //---------------- PATH EXECUTABLES ----------------
+    refresh_exec_index();
+    vector<string> matches = exec_index_lookup(buffer);
+
+    if(matches.empty()){
+        cout<<"\a"<<flush;
+        tab_pressed_before = false;
+        return 0;
+    }
+
+    //---------------- UNIQUE MATCH LOGIC ----------------
+    if(matches.size() == 1){
+    	string full = matches[0]+" ";
+
+    	rl_point = rl_end = 0; // reset buffer
+    	rl_insert_text(full.c_str());
+    	rl_redisplay();
+
+    	tab_pressed_before = false;
+    	return 0;
+	}
+
+	//---------- LCP EXTENSION ----------
+    string lcp = longest_common_prefix(matches);
+
+    if(lcp.size() > buffer.size()){
+        string suffix = lcp.substr(buffer.size());
+        rl_insert_text(suffix.c_str());
+        rl_redisplay();
+        tab_pressed_before = false;
+        return 0;
+    }
+
+	//---------- DOUBLE TAB LISTING ----------
+	if(!tab_pressed_before){
+		cout<<"\a"<<flush;
+		tab_pressed_before = true;
+	} 
+	else{
+		cout<<"\n";
+		for(size_t i=0; i<matches.size(); i++){
+			cout<<matches[i];
+			if(i+1<matches.size()) cout << "  ";
+		}
+		cout<<"\n$ ";
+		cout.flush();
+
+		// restore readline state
+		rl_insert_text(buffer.c_str());
+		rl_redisplay();
+
+		tab_pressed_before = false;
+	}
+    return 0;
+}
+
+// ------------------------------------------------------------
+// History search index (trigram postings over the history text)
+// ------------------------------------------------------------
+static string hist_text;					// every history line, back to back
+static vector<uint32_t> hist_starts;		// line i is hist_text[hist_starts[i], hist_starts[i+1])
+static unordered_map<uint32_t, vector<uint32_t>> hist_trigrams;	// lowercase trigram -> line ids, ascending
+
+// Helper: Text of an indexed history line
+string_view history_line(uint32_t id){
+    size_t end = id+1 < hist_starts.size() ? hist_starts[id+1] : hist_text.size();
+    return string_view(hist_text).substr(hist_starts[id], end-hist_starts[id]);
+}
+
+// Helper: Packs three lowercased bytes into a posting list key
+uint32_t trigram_key(const char* p){
+    return (uint32_t(uint8_t(tolower(p[0]))) << 16) | (uint32_t(uint8_t(tolower(p[1]))) << 8) | uint8_t(tolower(p[2]));
+}
+
+/* Helper:
+		Adds a line to readline's history and to the search index. Every
+		history insertion goes through here so line ids stay equal to
+		readline's history offsets. */
+void history_add(const string& line){
+    add_history(line.c_str());
+    uint32_t id = hist_starts.size();
+    hist_starts.push_back(hist_text.size());
+    hist_text += line;
+    for(size_t i=0; i+3<=line.size(); i++){
+        auto& postings = hist_trigrams[trigram_key(line.data()+i)];
+        if(postings.empty() || postings.back() != id) postings.push_back(id);
+    }
+}
+
+// Helper: Case-insensitive substring search
+size_t find_nocase(string_view hay, string_view needle){
+    if(needle.size() > hay.size()) return string_view::npos;
+    for(size_t i=0; i+needle.size()<=hay.size(); i++){
+        size_t k = 0;
+        while(k<needle.size() && tolower(hay[i+k])==tolower(needle[k])) k++;
+        if(k == needle.size()) return i;
+    }
+    return string_view::npos;
+}
+
+// Helper: Whether the query's characters appear in order in the line
+bool fuzzy_match(string_view line, string_view query){
+    size_t k = 0;
+    for(size_t i=0; i<line.size() && k<query.size(); i++){
+        if(tolower(line[i]) == tolower(query[k])) k++;
+    }
+    return k == query.size();
+}
+
+/* Helper:
+		Ranked history search. Candidates come from the shortest posting
+		list among the query's trigrams (queries under three characters
+		scan every line), then are verified and ranked:
+		exact line > prefix > match at a word start > substring > fuzzy
+		(characters in order), newest first within each rank. Repeated
+		lines are reported once, at their newest position. */
+vector<uint32_t> search_history(string_view query, size_t limit){
+    enum { EXACT, PREFIX, WORD, SUBSTRING, FUZZY, RANKS };
+    vector<uint32_t> ranked[RANKS];
+    unordered_set<string_view> seen;
+    uint32_t count = hist_starts.size();
+
+    const vector<uint32_t>* candidates = nullptr;
+    if(query.size() >= 3){
+        static const vector<uint32_t> none;
+        for(size_t i=0; i+3<=query.size(); i++){
+            auto it = hist_trigrams.find(trigram_key(query.data()+i));
+            const vector<uint32_t>* list = it == hist_trigrams.end() ? &none : &it->second;
+            if(!candidates || list->size() < candidates->size()) candidates = list;
+        }
+    }
+
+    auto consider = [&](uint32_t id){
+        string_view line = history_line(id);
+        if(!seen.insert(line).second) return;
+        size_t pos = find_nocase(line, query);
+        if(pos == string_view::npos){
+            seen.erase(line);
+            return;
+        }
+        if(pos == 0) ranked[line.size()==query.size() ? EXACT : PREFIX].push_back(id);
+        else if(isspace(static_cast<unsigned char>(line[pos-1])) || line[pos-1]=='/') ranked[WORD].push_back(id);
+        else ranked[SUBSTRING].push_back(id);
+    };
+    if(candidates){
+        for(auto it = candidates->rbegin(); it != candidates->rend(); ++it) consider(*it);
+    }
+    else{
+        for(uint32_t id = count; id-- > 0; ) consider(id);
+    }
+
+    size_t found = 0;
+    for(int r=EXACT; r<FUZZY; r++) found += ranked[r].size();
+    if(found < limit && !query.empty()){
+        for(uint32_t id = count; id-- > 0 && found < limit; ){
+            string_view line = history_line(id);
+            if(seen.count(line) || !fuzzy_match(line, query)) continue;
+            seen.insert(line);
+            ranked[FUZZY].push_back(id);
+            found++;
+        }
+    }
+
+    vector<uint32_t> result;
+    for(int r=EXACT; r<RANKS && result.size()<limit; r++){
+        for(uint32_t id : ranked[r]){
+            if(result.size() == limit) break;
+            result.push_back(id);
+        }
+    }
+    return result;
+}
+
+/* Helper:
+		Ctrl-R: incremental search over the index. Typing refines the
+		query, Ctrl-R steps to the next ranked match, Backspace shortens
+		the query, Enter runs the match, Ctrl-G/Esc restores the original
+		line, and any other key leaves the match in the buffer for editing. */
+int handle_reverse_search(int, int){
+    string saved_line = rl_line_buffer;
+    int saved_point = rl_point;
+    string query;
+    size_t nth = 0;
+    vector<uint32_t> matches;
+    bool refresh = true;
+
+    rl_save_prompt();
+    while(true){
+        if(refresh){
+            matches = query.empty() ? vector<uint32_t>() : search_history(query, 256);
+            refresh = false;
+        }
+        const char* state = (!query.empty() && matches.empty()) ? "failed " : "";
+        rl_message("(%sreverse-i-search)`%s': ", state, query.c_str());
+        if(nth < matches.size()){
+            string line(history_line(matches[nth]));
+            rl_replace_line(line.c_str(), 0);
+            size_t pos = find_nocase(line, query);
+            rl_point = pos == string::npos ? 0 : pos;
+        }
+        else if(query.empty()){
+            rl_replace_line(saved_line.c_str(), 0);
+            rl_point = saved_point;
+        }
+        rl_redisplay();
+
+        int c = rl_read_key();
+        if(c == CTRL('R')){
+            if(nth+1 < matches.size()) nth++;
+            else rl_ding();
+        }
+        else if(c == 127 || c == CTRL('H')){
+            if(!query.empty()) query.pop_back();
+            nth = 0;
+            refresh = true;
+        }
+        else if(c == CTRL('G') || c == ESC){
+            rl_replace_line(saved_line.c_str(), 0);
+            rl_point = saved_point;
+            break;
+        }
+        else if(c == '\r' || c == '\n'){
+            rl_restore_prompt();
+            rl_clear_message();
+            rl_done = 1;
+            return 0;
+        }
+        else if(c >= 32 && c < 127){
+            query += static_cast<char>(c);
+            nth = 0;
+            refresh = true;
+        }
+        else{
+            rl_execute_next(c);
+            break;
+        }
+    }
+    rl_restore_prompt();
+    rl_clear_message();
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Persistent history (append-only HISTFILE)
+// ------------------------------------------------------------
+static string histfile_path;
+static int histfile_fd = -1;				// O_APPEND; one writev per accepted line
+static atomic<off_t> histfile_compact_at{1 << 20};	// file size that triggers compaction
+static thread* history_compactor = nullptr;
+static atomic<bool> history_compacting{false};
+
+// Helper: Reads a positive integer shell variable
+long env_number(const char* name, long fallback){
+    const string* value = get_var(name);
+    if(!value || value->empty()) return fallback;
+    const char* v = value->c_str();
+    char* end = nullptr;
+    long n = strtol(v, &end, 10);
+    return (*end == '\0' && n > 0) ? n : fallback;
+}
+
+// Helper: Last '\n' in data[0, len) (memrchr is not available everywhere)
+const char* find_last_newline(const char* data, size_t len){
+#ifdef __GLIBC__
+    return static_cast<const char*>(memrchr(data, '\n', len));
+#else
+    while(len > 0){
+        if(data[--len] == '\n') return data+len;
+    }
+    return nullptr;
+#endif
+}
+
+/* Helper:
+		Loads the last `window` lines of a history file into readline.
+		The file is mapped rather than read, and only the tail is
+		touched: the start of the window is found by walking newlines
+		backwards from the end. */
+void load_history_tail(const string& path, long window){
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return;
+
+    const char* data = static_cast<const char*>(map);
+    size_t start = size;
+    if(start > 0 && data[start-1] == '\n') start--;	// trailing newline ends the last line
+    for(long lines = 0; start > 0; ){
+        const char* nl = find_last_newline(data, start);
+        if(!nl){
+            start = 0;
+            break;
+        }
+        if(++lines == window){
+            start = nl-data+1;
+            break;
+        }
+        start = nl-data;
+    }
+
+    string line;
+    for(size_t pos = start; pos < size; ){
+        const char* nl = static_cast<const char*>(memchr(data+pos, '\n', size-pos));
+        size_t end = nl ? nl-data : size;
+        if(end > pos){
+            line.assign(data+pos, end-pos);
+            history_add(line);
+        }
+        pos = end+1;
+    }
+    munmap(map, size);
+}
+
+/* Helper:
+		Rewrites the history file keeping the newest `keep` distinct
+		lines (a repeated command keeps only its latest position). The
+		new contents go to a temp file that is renamed over the original,
+		so a crash never leaves a truncated history. Holding LOCK_EX keeps
+		appends from other shells out of the window between read and rename. */
+void compact_history_file(string path, long keep){
+    // Another shell may have compacted and replaced the file while this one
+    // waited for the lock; then the new file is the one to compact (an
+    // empty read of the old one must never be renamed over it)
+    int fd = -1;
+    struct stat st;
+    for(int attempt = 0; attempt < 3 && fd < 0; attempt++){
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) break;
+        flock(fd, LOCK_EX);
+        if(fstat(fd, &st) == 0 && st.st_nlink > 0) break;
+        flock(fd, LOCK_UN);
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0){
+        history_compacting = false;
+        return;
+    }
+
+    string data(st.st_size, '\0');
+    size_t got = 0;
+    while(got < data.size()){
+        ssize_t r = read(fd, &data[got], data.size()-got);
+        if(r <= 0) break;
+        got += r;
+    }
+    data.resize(got);
+
+    // newest first, skipping lines already kept
+    vector<string_view> kept;
+    unordered_set<string_view> seen;
+    size_t end = data.size();
+    while(end > 0 && static_cast<long>(kept.size()) < keep){
+        size_t nl = data.rfind('\n', end-1);
+        size_t begin = (nl == string::npos) ? 0 : nl+1;
+        string_view line(data.data()+begin, end-begin);
+        if(!line.empty() && line.back() == '\n') line.remove_suffix(1);
+        if(!line.empty() && seen.insert(line).second) kept.push_back(line);
+        if(nl == string::npos) break;
+        end = nl;
+    }
+
+    string tmp = path+".tmp."+to_string(getpid());
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(out >= 0){
+        string compacted;
+        compacted.reserve(data.size());
+        for(auto it = kept.rbegin(); it != kept.rend(); ++it){
+            compacted.append(it->data(), it->size());
+            compacted += '\n';
+        }
+        bool ok = write(out, compacted.data(), compacted.size()) == static_cast<ssize_t>(compacted.size());
+        ok = fsync(out) == 0 && ok;
+        close(out);
+        if(ok && rename(tmp.c_str(), path.c_str()) == 0){
+            histfile_compact_at = max<off_t>(histfile_compact_at, 2*static_cast<off_t>(compacted.size()));
+        }
+        else unlink(tmp.c_str());
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    history_compacting = false;
+}
+
+// Helper: Blocks until a running compaction (if any) has finished
+void wait_history_compactor(){
+    if(!history_compactor) return;
+    history_compactor->join();
+    delete history_compactor;
+    history_compactor = nullptr;
+}
+
+// Helper: Loads HISTFILE and opens it for appending
+void open_history_file(const string& path){
+    histfile_path = path;
+    load_history_tail(path, env_number("HISTSIZE", 10000));
+    histfile_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    histfile_compact_at = env_number("HISTFILE_COMPACT_BYTES", 1 << 20);
+}
+
+void append_history_file(const string& line);
+
+/* Helper:
+		Adds an accepted line to the in-memory history and appends it to
+		HISTFILE right away, so a crash loses nothing. The data goes out
+		in a single O_APPEND writev; the shared lock and link-count check
+		make sure it lands in the current file if another shell (or our
+		compactor) has just replaced it. */
+void record_history(const string& line){
+    history_add(line);
+    append_history_file(line);
+}
+
+// Helper: The HISTFILE half of record_history (multiplexed sessions keep their own in-memory lists)
+void append_history_file(const string& line){
+    TRACE_SPAN("history_write");
+    if(histfile_fd < 0) return;
+
+    flock(histfile_fd, LOCK_SH);
+    struct stat st;
+    if(fstat(histfile_fd, &st) == 0 && st.st_nlink == 0){
+        flock(histfile_fd, LOCK_UN);
+        close(histfile_fd);
+        histfile_fd = open(histfile_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if(histfile_fd < 0) return;
+        flock(histfile_fd, LOCK_SH);
+        fstat(histfile_fd, &st);
+    }
+    struct iovec iov[2] = {
+        {const_cast<char*>(line.data()), line.size()},
+        {const_cast<char*>("\n"), 1},
+    };
+    ssize_t written = writev(histfile_fd, iov, 2);
+    flock(histfile_fd, LOCK_UN);
+
+    if(written > 0 && st.st_size+written > histfile_compact_at && !history_compacting.exchange(true)){
+        wait_history_compactor();
+        history_compactor = new thread(compact_history_file, histfile_path, env_number("HISTFILESIZE", 10000));
+    }
+}
+
+// ------------------------------------------------------------
+// Buffered output stream over a raw file descriptor
+// ------------------------------------------------------------
+class FdOutBuf : public streambuf {
+public:
+    explicit FdOutBuf(int fd, size_t size = 65536) : fd(fd), buf(size) {
+        setp(buf.data(), buf.data()+buf.size());
+    }
+    ~FdOutBuf() override { sync(); }
+
+protected:
+    int overflow(int c) override {
+        if(!flush_buffer()) return traits_type::eof();
+        if(c != traits_type::eof()){
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override { return flush_buffer() ? 0 : -1; }
+
+    // Large writes bypass the buffer once it has been drained
+    streamsize xsputn(const char* s, streamsize n) override {
+        if(n < epptr()-pptr()){
+            memcpy(pptr(), s, n);
+            pbump(n);
+            return n;
+        }
+        if(!flush_buffer() || !write_all(s, n)) return 0;
+        return n;
+    }
+
+private:
+    bool write_all(const char* p, size_t n){
+        while(n > 0 && !failed){
+            ssize_t w = write(fd, p, n);
+            if(w < 0){
+                if(errno == EINTR) continue;
+                failed = true;	// EPIPE: reader went away, drop the rest
+                break;
+            }
+            p += w;
+            n -= w;
+        }
+        return !failed;
+    }
+
+    bool flush_buffer(){
+        bool ok = write_all(pbase(), pptr()-pbase());
+        setp(buf.data(), buf.data()+buf.size());
+        return ok;
+    }
+
+    int fd;
+    vector<char> buf;
+    bool failed = false;
+};
+
+// ------------------------------------------------------------
+// Kernel-side copies
+// ------------------------------------------------------------
+/* `cat FILE` only moves bytes, so the shell's cat does it without
+   going through user space: splice() into pipes, copy_file_range() into
+   regular files (reflink/server-side copy where the filesystem can),
+   sendfile() into anything else (ttys, sockets). Each method falls back
+   to the next when the kernel refuses the combination of fds, ending
+   with a plain read/write loop. */
+enum class CopyMethod { SPLICE, COPY_FILE_RANGE, SENDFILE, READ_WRITE };
+
+// Helper: Copies in (from its current offset) to out until EOF; false with errno set on failure
+bool copy_fd(int in, int out){
+    CopyMethod method = CopyMethod::READ_WRITE;
+#ifdef __linux__
+    struct stat st;
+    if(fstat(out, &st) == 0){
+        if(S_ISFIFO(st.st_mode)) method = CopyMethod::SPLICE;
+        else if(S_ISREG(st.st_mode)) method = CopyMethod::COPY_FILE_RANGE;
+        else method = CopyMethod::SENDFILE;
+    }
+#endif
+    const size_t chunk = 1 << 20;
+    vector<char> buf;
+    while(true){
+        ssize_t n = 0;
+        switch(method){
+#ifdef __linux__
+            case CopyMethod::SPLICE:
+                n = splice(in, nullptr, out, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+                break;
+            case CopyMethod::COPY_FILE_RANGE:
+                n = copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+                break;
+            case CopyMethod::SENDFILE:
+                n = sendfile(out, in, nullptr, chunk);
+                break;
+#endif
+            default:{
+                if(buf.empty()) buf.resize(1 << 16);
+                n = read(in, buf.data(), buf.size());
+                for(ssize_t done = 0; n > 0 && done < n; ){
+                    ssize_t w = write(out, buf.data()+done, n-done);
+                    if(w < 0 && errno == EINTR) continue;
+                    if(w < 0) return false;
+                    done += w;
+                }
+            }
+        }
+        if(n == 0) return true;
+        if(n > 0) continue;
+        if(errno == EINTR) continue;
+        // fd combination not supported (O_APPEND target, cross-device, special files): degrade
+        bool unsupported = errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF;
+        if(!unsupported || method == CopyMethod::READ_WRITE) return false;
+        method = method == CopyMethod::COPY_FILE_RANGE ? CopyMethod::SENDFILE : CopyMethod::READ_WRITE;
+    }
+}
+
+// ------------------------------------------------------------
+// In-process utilities (cat, head, wc, true, false, test)
+// ------------------------------------------------------------
+/* Small commands that scripts run over and over, done inside the shell
+   through the loadable-builtin interface (shell_builtin.h). Each one
+   handles the common, unambiguous forms and declines the rest (unknown
+   options, devices, fifos, missing files, several files for head/wc),
+   which then run the real command with its exact behaviour and error
+   messages. Regular-file operands keep every in-process run finite. */
+bool write_all(int fd, const void* data, size_t len);
+
+// Helper: Checks whether path names a regular file (following symlinks)
+bool is_regular_file(const char* path){
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Helper: A utility's "NAME: WHAT: error" message
+void utility_error(int err_fd, const char* name, const char* what, int error){
+    string message = string(name)+": "+what+": "+strerror(error)+"\n";
+    write_all(err_fd, message.data(), message.size());
+}
+
+// Helper: Status of a utility that failed writing its output (EPIPE: as if killed by SIGPIPE)
+int write_failure(int err_fd, const char* name, int error){
+    if(error == EPIPE) return 128+SIGPIPE;
+    utility_error(err_fd, name, "write error", error);
+    return 1;
+}
+
+// Helper: A plain non-negative decimal count
+bool parse_count(const char* text, unsigned long long& count){
+    if(!isdigit(static_cast<unsigned char>(*text))) return false;
+    errno = 0;
+    char* end = nullptr;
+    count = strtoull(text, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// ---------- true / false ----------
+int true_accepts(int, char* const[]){ return SHELL_BUILTIN_ACCEPT; }
+int true_run(int, char* const[], int, int, int){ return 0; }
+int false_run(int, char* const[], int, int, int){ return 1; }
+
+// ---------- cat [FILE | -]... ----------
+// (`cat FILE` runs here only while the zerocopy option is on)
+int cat_accepts(int argc, char* const argv[]){
+    if(!use_zero_copy) return SHELL_BUILTIN_DECLINE;
+    bool reads_stdin = argc == 1;
+    for(int i=1; i<argc; i++){
+        if(strcmp(argv[i], "-") == 0) reads_stdin = true;
+        else if(argv[i][0] == '-' || !is_regular_file(argv[i])) return SHELL_BUILTIN_DECLINE;
+    }
+    return reads_stdin ? SHELL_BUILTIN_ACCEPT_STDIN : SHELL_BUILTIN_ACCEPT;
+}
+
+int cat_run(int argc, char* const argv[], int in_fd, int out_fd, int err_fd){
+    int status = 0;
+    struct stat out_st;
+    bool out_regular = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    for(int i = argc==1 ? 0 : 1; i<argc; i++){
+        bool from_stdin = argc == 1 || strcmp(argv[i], "-") == 0;
+        const char* name = argc == 1 ? "-" : argv[i];
+        int fd = from_stdin ? in_fd : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            utility_error(err_fd, "cat", name, errno);
+            status = 1;
+            continue;
+        }
+        // `cat f >> f` would copy f onto its own end forever
+        struct stat in_st;
+        if(out_regular && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino){
+            string message = string("cat: ")+name+": input file is output file\n";
+            write_all(err_fd, message.data(), message.size());
+            if(!from_stdin) close(fd);
+            status = 1;
+            continue;
+        }
+        bool ok = copy_fd(fd, out_fd);
+        int error = errno;
+        if(!from_stdin) close(fd);
+        if(!ok) return write_failure(err_fd, "cat", error);
+    }
+    return status;
+}
+
+// ---------- head [-n N | -c N | -N] [FILE] ----------
+struct HeadArgs {
+    bool bytes = false;
+    unsigned long long count = 10;
+    const char* file = nullptr;		// nullptr: stdin
+};
+
+bool parse_head_args(int argc, char* const argv[], HeadArgs& args){
+    int i = 1;
+    for(; i<argc && argv[i][0]=='-' && argv[i][1]; i++){
+        const char* arg = argv[i];
+        if(strcmp(arg, "--") == 0){
+            i++;
+            break;
+        }
+        const char* number;
+        if(isdigit(static_cast<unsigned char>(arg[1]))) number = arg+1;		// head -5
+        else if(arg[1]=='n' || arg[1]=='c'){
+            args.bytes = arg[1]=='c';
+            number = arg[2] ? arg+2 : i+1<argc ? argv[++i] : nullptr;
+        }
+        else return false;
+        if(!number || !parse_count(number, args.count)) return false;
+    }
+    if(argc-i > 1) return false;
+    if(i < argc && strcmp(argv[i], "-") != 0){
+        if(!is_regular_file(argv[i])) return false;
+        args.file = argv[i];
+    }
+    return true;
+}
+
+int head_accepts(int argc, char* const argv[]){
+    HeadArgs args;
+    if(!parse_head_args(argc, argv, args)) return SHELL_BUILTIN_DECLINE;
+    return args.file ? SHELL_BUILTIN_ACCEPT : SHELL_BUILTIN_ACCEPT_STDIN;
+}
+
+/* Copies the first lines or bytes. Like head itself, on a seekable
+   stdin the offset is put back right after the part it used, so the
+   next command reads on from there. */
+int head_run(int argc, char* const argv[], int in_fd, int out_fd, int err_fd){
+    HeadArgs args;
+    parse_head_args(argc, argv, args);
+    int fd = args.file ? open(args.file, O_RDONLY | O_CLOEXEC) : in_fd;
+    if(fd < 0){
+        utility_error(err_fd, "head", args.file, errno);
+        return 1;
+    }
+    vector<char> buf(1 << 16);
+    unsigned long long left = args.count;
+    int status = 0;
+    while(left > 0){
+        size_t want = args.bytes ? min<unsigned long long>(left, buf.size()) : buf.size();
+        ssize_t n = read(fd, buf.data(), want);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0){
+            utility_error(err_fd, "head", args.file ? args.file : "standard input", errno);
+            status = 1;
+            break;
+        }
+        if(n == 0) break;
+        size_t take = n;
+        if(args.bytes) left -= take;
+        else{
+            const char* p = buf.data();
+            const char* end = p+n;
+            while(left > 0 && (p = static_cast<const char*>(memchr(p, '\n', end-p)))){
+                p++;
+                left--;
+            }
+            if(left == 0) take = p-buf.data();
+        }
+        if(!write_all(out_fd, buf.data(), take)){
+            status = write_failure(err_fd, "head", errno);
+            break;
+        }
+        if(take < static_cast<size_t>(n) && !args.file) lseek(fd, -static_cast<off_t>(n-take), SEEK_CUR);
+    }
+    if(args.file) close(fd);
+    return status;
+}
+
+// ---------- wc [-lwc] [FILE] ----------
+struct WcArgs {
+    bool lines = false, words = false, bytes = false;
+    const char* file = nullptr;		// nullptr: stdin
+    bool named = false;				// an operand was given (- included)
+};
+
+// Helper: Checks whether the C locale's byte classes apply (wc -w elsewhere counts multibyte characters)
+bool c_ctype_locale(){
+    for(const char* name : {"LC_ALL", "LC_CTYPE", "LANG"}){
+        const string* value = get_var(name);
+        if(value && !value->empty()) return *value == "C" || *value == "POSIX";
+    }
+    return true;
+}
+
+bool parse_wc_args(int argc, char* const argv[], WcArgs& args){
+    int i = 1;
+    for(; i<argc && argv[i][0]=='-' && argv[i][1]; i++){
+        for(const char* c = argv[i]+1; *c; c++){
+            if(*c == 'l') args.lines = true;
+            else if(*c == 'w') args.words = true;
+            else if(*c == 'c') args.bytes = true;
+            else return false;
+        }
+    }
+    if(!args.lines && !args.words && !args.bytes) args.lines = args.words = args.bytes = true;
+    if(args.words && !c_ctype_locale()) return false;
+    if(argc-i > 1) return false;
+    if(i < argc){
+        args.named = true;
+        if(strcmp(argv[i], "-") != 0){
+            if(!is_regular_file(argv[i])) return false;
+            args.file = argv[i];
+        }
+    }
+    return true;
+}
+
+int wc_accepts(int argc, char* const argv[]){
+    WcArgs args;
+    if(!parse_wc_args(argc, argv, args)) return SHELL_BUILTIN_DECLINE;
+    return args.file ? SHELL_BUILTIN_ACCEPT : SHELL_BUILTIN_ACCEPT_STDIN;
+}
+
+/* Counts as GNU wc does in the C locale: a word is a run of bytes
+   between whitespace containing a printable character. Counts are
+   padded to the width of the input's size (7 for pipes and the like)
+   unless there is only one. */
+int wc_run(int argc, char* const argv[], int in_fd, int out_fd, int err_fd){
+    WcArgs args;
+    parse_wc_args(argc, argv, args);
+    int fd = args.file ? open(args.file, O_RDONLY | O_CLOEXEC) : in_fd;
+    if(fd < 0){
+        utility_error(err_fd, "wc", args.file, errno);
+        return 1;
+    }
+    unsigned long long lines = 0, words = 0, bytes = 0;
+    bool in_word = false;
+    vector<char> buf(1 << 16);
+    int status = 0;
+    while(true){
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0){
+            utility_error(err_fd, "wc", args.file ? args.file : "standard input", errno);
+            status = 1;
+            break;
+        }
+        if(n == 0) break;
+        bytes += n;
+        if(!args.words){
+            for(const char* p = buf.data(), *end = p+n; (p = static_cast<const char*>(memchr(p, '\n', end-p))); p++) lines++;
+            continue;
+        }
+        for(ssize_t i=0; i<n; i++){
+            unsigned char c = buf[i];
+            if(c=='\n') lines++;
+            if(c==' ' || (c>='\t' && c<='\r')){
+                words += in_word;
+                in_word = false;
+            }
+            else if(c>=0x20 && c<0x7f) in_word = true;
+        }
+    }
+    words += in_word;
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if(args.file) close(fd);
+    int width = 1;
+    if(args.lines+args.words+args.bytes > 1){
+        width = regular ? to_string(st.st_size).size() : 7;
+    }
+    string line;
+    char num[32];
+    const pair<bool, unsigned long long> counts[] = {{args.lines, lines}, {args.words, words}, {args.bytes, bytes}};
+    for(auto [on, value] : counts){
+        if(!on) continue;
+        snprintf(num, sizeof num, "%*llu", line.empty() ? width : width+1, value);
+        line += num;
+    }
+    if(args.named) line += string(" ")+(args.file ? args.file : "-");
+    line += '\n';
+    if(!write_all(out_fd, line.data(), line.size())) return write_failure(err_fd, "wc", errno);
+    return status;
+}
+
+// ---------- test EXPR / [ EXPR ] ----------
+/* POSIX test by argument count (up to four; -a, -o and longer
+   expressions go to the real test). -1: a syntax or number error,
+   which the real command reports. */
+int test_file(const char* op, const char* path){
+    struct stat st;
+    bool link = strcmp(op, "-h")==0 || strcmp(op, "-L")==0;
+    if((link ? lstat(path, &st) : stat(path, &st)) != 0) return 1;
+    switch(op[1]){
+        case 'e': return 0;
+        case 'f': return !S_ISREG(st.st_mode);
+        case 'd': return !S_ISDIR(st.st_mode);
+        case 'b': return !S_ISBLK(st.st_mode);
+        case 'c': return !S_ISCHR(st.st_mode);
+        case 'p': return !S_ISFIFO(st.st_mode);
+        case 'S': return !S_ISSOCK(st.st_mode);
+        case 'h': case 'L': return !S_ISLNK(st.st_mode);
+        case 's': return st.st_size == 0;
+        case 'g': return !(st.st_mode & S_ISGID);
+        case 'u': return !(st.st_mode & S_ISUID);
+        case 'k': return !(st.st_mode & S_ISVTX);
+        case 'r': return access(path, R_OK) != 0;
+        case 'w': return access(path, W_OK) != 0;
+        case 'x': return access(path, X_OK) != 0;
+    }
+    return -1;
+}
+
+bool is_test_unary(const char* op){
+    return op[0]=='-' && op[1] && !op[2] && strchr("efdbcpShLsgukrwxzn", op[1]);
+}
+
+bool is_test_binary(const char* op){
+    static const char* const ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for(const char* o : ops){
+        if(strcmp(op, o) == 0) return true;
+    }
+    return false;
+}
+
+// Helper: test's integer operand (surrounding blanks allowed)
+bool test_integer(const char* text, long long& value){
+    errno = 0;
+    char* end = nullptr;
+    value = strtoll(text, &end, 10);
+    if(end == text || errno != 0) return false;
+    while(isspace(static_cast<unsigned char>(*end))) end++;
+    return *end == '\0';
+}
+
+// Helper: Modification time in nanoseconds
+long long mtime_ns(const struct stat& st){
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+int test_binary(const char* a, const char* op, const char* b){
+    if(strcmp(op, "=")==0 || strcmp(op, "==")==0) return strcmp(a, b) != 0;
+    if(strcmp(op, "!=")==0) return strcmp(a, b) == 0;
+    if(strcmp(op, "-nt")==0 || strcmp(op, "-ot")==0 || strcmp(op, "-ef")==0){
+        struct stat sa, sb;
+        bool has_a = stat(a, &sa) == 0, has_b = stat(b, &sb) == 0;
+        if(op[1]=='e') return !(has_a && has_b && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+        if(op[1]=='n') return !(has_a && (!has_b || mtime_ns(sa) > mtime_ns(sb)));
+        return !(has_b && (!has_a || mtime_ns(sb) > mtime_ns(sa)));
+    }
+    long long x, y;
+    if(!test_integer(a, x) || !test_integer(b, y)) return -1;
+    if(strcmp(op, "-eq")==0) return x != y;
+    if(strcmp(op, "-ne")==0) return x == y;
+    if(strcmp(op, "-lt")==0) return x >= y;
+    if(strcmp(op, "-le")==0) return x > y;
+    if(strcmp(op, "-gt")==0) return x <= y;
+    return x < y;
+}
+
+int test_eval(char* const args[], int n){
+    auto negate = [](int status){ return status < 0 ? status : !status; };
+    switch(n){
+        case 0: return 1;
+        case 1: return args[0][0] == '\0';
+        case 2:
+            if(strcmp(args[0], "!") == 0) return negate(test_eval(args+1, 1));
+            if(!is_test_unary(args[0])) return -1;
+            if(args[0][1]=='z') return args[1][0] != '\0';
+            if(args[0][1]=='n') return args[1][0] == '\0';
+            return test_file(args[0], args[1]);
+        case 3:
+            if(is_test_binary(args[1])) return test_binary(args[0], args[1], args[2]);
+            if(strcmp(args[0], "!") == 0) return negate(test_eval(args+1, 2));
+            if(strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) return test_eval(args+1, 1);
+            return -1;
+        case 4:
+            if(strcmp(args[0], "!") == 0) return negate(test_eval(args+1, 3));
+            if(strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) return test_eval(args+1, 2);
+            return -1;
+    }
+    return -1;
+}
+
+// Helper: The expression's words: argv minus the command name (and a closing ] for [), or n = -1
+char* const* test_args(int argc, char* const argv[], int& n){
+    n = argc-1;
+    if(strcmp(argv[0], "[") == 0){
+        if(n == 0 || strcmp(argv[argc-1], "]") != 0){
+            n = -1;
+            return nullptr;
+        }
+        n--;
+    }
+    for(int i=1; i<=n; i++){
+        if(strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-t") == 0) n = -1;
+    }
+    return argv+1;
+}
+
+int test_accepts(int argc, char* const argv[]){
+    int n;
+    char* const* args = test_args(argc, argv, n);
+    if(n < 0 || n > 4) return SHELL_BUILTIN_DECLINE;
+    return test_eval(args, n) < 0 ? SHELL_BUILTIN_DECLINE : SHELL_BUILTIN_ACCEPT;
+}
+
+int test_run(int argc, char* const argv[], int, int, int){
+    int n;
+    char* const* args = test_args(argc, argv, n);
+    return test_eval(args, n) == 0 ? 0 : 1;
+}
+
+static const shell_builtin bundled_utilities[] = {
+    {SHELL_BUILTIN_ABI_VERSION, "true", true_accepts, true_run},
+    {SHELL_BUILTIN_ABI_VERSION, "false", true_accepts, false_run},
+    {SHELL_BUILTIN_ABI_VERSION, "cat", cat_accepts, cat_run},
+    {SHELL_BUILTIN_ABI_VERSION, "head", head_accepts, head_run},
+    {SHELL_BUILTIN_ABI_VERSION, "wc", wc_accepts, wc_run},
+    {SHELL_BUILTIN_ABI_VERSION, "test", test_accepts, test_run},
+    {SHELL_BUILTIN_ABI_VERSION, "[", test_accepts, test_run},
+};
+
+// ------------------------------------------------------------
+// Parallel execution (parallel builtin)
+// ------------------------------------------------------------
+/* parallel [-j N] [-k] command [args...] [::: input...]
+   Runs the command once per input (the words after :::, or else the
+   lines of stdin), at most N at a time (default: one per core). Each
+   run's stdout and stderr are collected through pipes and written out
+   in one piece when it finishes: in completion order, or in input
+   order with -k. The status is the number of failed runs (at most 101,
+   as in GNU parallel). Inputs are read from stdin only as free slots
+   need them, so a slow producer can feed a long-running fan-out. */
+struct ParallelRun {
+    size_t index;			// input position, for -k
+    pid_t pid = -1;
+    int fds[2] = {-1, -1};	// stdout / stderr pipe read ends, -1 after EOF
+    string output[2];
+    int status = 0;
+    bool done = false;
+};
+
+// Helper: One template word with {} {.} {/} {#} replaced for an input
+string parallel_word(string_view word, const string& input, size_t seq, bool& used){
+    string result;
+    for(size_t i=0; i<word.size(); ){
+        if(word.compare(i, 2, "{}") == 0){
+            result += input;
+            i += 2;
+        }
+        else if(word.compare(i, 3, "{.}") == 0){
+            size_t slash = input.rfind('/');
+            size_t dot = input.rfind('.');
+            result += (dot != string::npos && (slash == string::npos || dot > slash+1)) ? input.substr(0, dot) : input;
+            i += 3;
+        }
+        else if(word.compare(i, 3, "{/}") == 0){
+            size_t slash = input.rfind('/');
+            result += slash == string::npos ? input : input.substr(slash+1);
+            i += 3;
+        }
+        else if(word.compare(i, 3, "{#}") == 0){
+            result += to_string(seq);
+            i += 3;
+            continue;		// a job number alone doesn't consume the input
+        }
+        else{
+            result += word[i++];
+            continue;
+        }
+        used = true;
+    }
+    return result;
+}
+
+// Helper: Starts one run with its output on fresh pipes; pid stays -1 if it couldn't be started
+void start_parallel_run(ParallelRun& run, const vector<string_view>& command, const string& input, int null_fd){
+    vector<string> words;
+    bool used = false;
+    for(auto word : command) words.push_back(parallel_word(word, input, run.index+1, used));
+    if(!used) words.push_back(input);
+    vector<string_view> argv(words.begin(), words.end());
+
+    int out_pipe[2], err_pipe[2];
+    if(pipe2(out_pipe, O_CLOEXEC) == -1) return;
+    if(pipe2(err_pipe, O_CLOEXEC) == -1){
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return;
+    }
+    SpawnIO io;
+    io.in = null_fd;
+    io.out = out_pipe[1];
+    io.err = err_pipe[1];
+    run.pid = spawn_command(argv, io);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if(run.pid < 0){
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return;
+    }
+    run.fds[0] = out_pipe[0];
+    run.fds[1] = err_pipe[0];
+}
+
+int run_parallel(const vector<string_view>& tokens, ostream& out, ostream& err){
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+    size_t i = 1;
+    for(; i<tokens.size() && tokens[i].size() > 1 && tokens[i][0] == '-'; i++){
+        if(tokens[i] == "--"){
+            i++;
+            break;
+        }
+        if(tokens[i] == "-k") keep_order = true;
+        else if(tokens[i].substr(0, 2) == "-j"){
+            string_view n = tokens[i].size() > 2 ? tokens[i].substr(2) : (i+1 < tokens.size() ? tokens[++i] : "");
+            max_jobs = atol(string(n).c_str());
+            if(max_jobs <= 0){
+                err<<"parallel: -j: invalid job count\n";
+                return 2;
+            }
+        }
+        else{
+            err<<"parallel: "<<tokens[i]<<": invalid option\n";
+            err<<"parallel: usage: parallel [-j N] [-k] command [args...] [::: input...]\n";
+            return 2;
+        }
+    }
+    if(max_jobs <= 0) max_jobs = 1;
+
+    vector<string_view> command;
+    deque<string> inputs;
+    bool from_stdin = true;
+    for(; i<tokens.size(); i++){
+        if(tokens[i] == ":::" && from_stdin){
+            from_stdin = false;
+            continue;
+        }
+        if(from_stdin) command.push_back(tokens[i]);
+        else inputs.emplace_back(tokens[i]);
+    }
+    if(command.empty()){
+        err<<"parallel: usage: parallel [-j N] [-k] command [args...] [::: input...]\n";
+        return 2;
+    }
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    string pending;			// stdin read so far that doesn't end in a newline yet
+    bool input_done = !from_stdin;
+    list<ParallelRun> runs;	// started, not yet written out
+    size_t started = 0, next_output = 0;
+    int running = 0, failed = 0;
+    bool interrupted = false;	// a run was stopped by Ctrl-C: start no more, stop the rest
+    char buf[65536];
+
+    // writes out finished runs (with -k only the finished prefix, in input order)
+    auto emit = [&](){
+        for(auto it = runs.begin(); it != runs.end(); ){
+            if(!it->done || (keep_order && it->index != next_output)){
+                if(keep_order) break;
+                ++it;
+                continue;
+            }
+            out<<it->output[0];
+            out.flush();
+            err<<it->output[1];
+            err.flush();
+            if(it->status != 0) failed++;
+            next_output++;
+            it = runs.erase(it);
+        }
+    };
+
+    for(;;){
+        // fill free slots
+        while(running < max_jobs && !inputs.empty()){
+            runs.emplace_back();
+            ParallelRun& run = runs.back();
+            run.index = started++;
+            start_parallel_run(run, command, inputs.front(), null_fd);
+            inputs.pop_front();
+            if(run.pid < 0){
+                run.status = spawn_failure_status;
+                run.done = true;
+            }
+            else running++;
+        }
+        emit();
+        if(running == 0 && inputs.empty() && input_done) break;
+
+        vector<struct pollfd> polled;
+        vector<pair<ParallelRun*, int>> owners;
+        for(auto& run : runs){
+            for(int k=0; k<2; k++){
+                if(run.fds[k] < 0) continue;
+                polled.push_back({run.fds[k], POLLIN, 0});
+                owners.push_back({&run, k});
+            }
+        }
+        bool want_input = !input_done && running < max_jobs;
+        if(want_input) polled.push_back({STDIN_FILENO, POLLIN, 0});
+        if(poll(polled.data(), polled.size(), -1) < 0){
+            if(errno == EINTR) continue;
+            err<<"parallel: poll: "<<strerror(errno)<<"\n";
+            break;
+        }
+
+        for(size_t p=0; p<owners.size(); p++){
+            if(!polled[p].revents) continue;
+            auto [run, k] = owners[p];
+            ssize_t n = read(run->fds[k], buf, sizeof buf);
+            if(n < 0 && errno == EINTR) continue;
+            if(n > 0){
+                run->output[k].append(buf, n);
+                continue;
+            }
+            close(run->fds[k]);
+            run->fds[k] = -1;
+            if(run->fds[0] >= 0 || run->fds[1] >= 0) continue;
+            // both pipes at EOF: collect the exit status
+            int wstatus = 0;
+            struct rusage ru;
+            while(wait4(run->pid, &wstatus, 0, &ru) < 0 && errno == EINTR){}
+            command_usage.add(ru);
+            run->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+            run->done = true;
+            running--;
+            if(WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGINT && !interrupted){
+                interrupted = true;
+                inputs.clear();
+                input_done = true;
+                for(auto& other : runs){
+                    if(!other.done && other.pid > 0) kill(other.pid, SIGINT);
+                }
+            }
+        }
+        if(want_input && polled.back().revents){
+            ssize_t n = read(STDIN_FILENO, buf, sizeof buf);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0){
+                input_done = true;
+                if(!pending.empty()) inputs.push_back(std::move(pending));
+                continue;
+            }
+            pending.append(buf, n);
+            size_t start = 0;
+            for(size_t nl; (nl = pending.find('\n', start)) != string::npos; start = nl+1){
+                inputs.push_back(pending.substr(start, nl-start));
+            }
+            pending.erase(0, start);
+        }
+    }
+    if(null_fd >= 0) close(null_fd);
+    return interrupted ? 128+SIGINT : min(failed, 101);
+}
+
+// ------------------------------------------------------------
+// Builtins (output goes to the given streams, so pipeline stages
+// can write straight into their pipe)
+// ------------------------------------------------------------
+// echo [args...]
+int builtin_echo(const vector<string_view>& tokens, ostream& out, ostream&){
+    for(size_t i=1; i<tokens.size(); i++){
+        out<<tokens[i];
+        if(i+1<tokens.size()) out << " ";
+    }
+    out<<"\n";
+    return 0;
+}
+
+/* history [n] | -r FILE | -w FILE | -a FILE | -s PATTERN [n]: list, read,
+   write, append or search the history */
+int builtin_history(const vector<string_view>& tokens, ostream& out, ostream& err){
+	if(tokens.size()==3 && tokens[1]=="-r"){
+		std::ifstream file(tokens[2].data());
+		if(!file.is_open()) return 1;
+		string line;
+		while(getline(file, line)){
+			if(line.empty()) continue;
+			history_add(line);
+		}
+		return 0;
+	}
+	else if(tokens.size()==3 && tokens[1]=="-w"){
+		std::ofstream file(tokens[2].data());
+		if(!file.is_open()){
+			err<<"History cannot write to "<<tokens[2]<<"\n";
+			return 1;
+		}
+		int len = history_length;
+		for(int i=1; i<=len; i++){
+    		HIST_ENTRY* entry = history_get(i);
+    		if(entry && entry->line){
+    			file<<entry->line<<"\n";
+    		}
+		}
+		return 0;
+	}
+	else if(tokens.size()>=3 && tokens[1]=="-s"){
+		// history -s pattern [n]: ranked search, best match first
+		size_t limit = 20;
+		if(tokens.size() == 4) limit = max(1L, strtol(tokens[3].data(), nullptr, 10));
+		uint32_t self = hist_starts.size()-1;	// this very command
+		for(uint32_t id : search_history(tokens[2], limit+1)){
+			if(id == self) continue;
+			if(limit-- == 0) break;
+			out<<"    "<<history_base+id<<"  "<<history_line(id)<<"\n";
+		}
+		return 0;
+	}
+	else if(tokens.size()==3 && tokens[1]=="-a"){
+		std::ofstream file(tokens[2].data(), std::ios::app);
+		if(!file.is_open()){
+			err<<"History cannot write to "<<tokens[2]<<"\n";
+			return 1;
+		}
+		int len = history_length;
+		for(int i=last_history_written+1; i<=len; i++){
+    		HIST_ENTRY* entry = history_get(i);
+    		if(entry && entry->line){
+        		file<<entry->line<<"\n";
+    		}
+		}
+		last_history_written = len;
+		return 0;
+	}
+
+	int len = history_length;
+	int n = len;
+	if(tokens.size() == 2){
+		char* end = nullptr;
+		n = strtol(tokens[1].data(), &end, 10);
+		if(*end != '\0'){
+			err<<"history: "<<tokens[1]<<": numeric argument required\n";
+			return 2;
+		}
+		if(n<0) n=0;
+	}
+	int start = max(1, len-n+1);
+	for(int i=start; i<=len; i++){
+    	HIST_ENTRY* entry = history_get(i);
+    	if(entry && entry->line){
+    		out<<"    "<<i<<"  "<<entry->line<<"\n";
+    	}
+	}
+    return 0;
+}
+
+// type NAME: builtin, keyword or the path it runs
+int builtin_type(const vector<string_view>& tokens, ostream& out, ostream&){
+    if(tokens.size() < 2) return 0;
+    if(tokens[1] == "time"){
+        out<<tokens[1]<<" is a shell keyword\n";
+    }
+    else if(find_builtin(tokens[1])){
+        out<<tokens[1]<<" is a shell builtin"<<"\n";
+    } 
+	else{
+        string full = find_command(tokens[1]);
+        if(full.empty()){
+            out << tokens[1] << ": not found\n";
+            return 1;
+        }
+        out << tokens[1] << " is " << full << "\n";
+    }
+    return 0;
+}
+
+// hash [-r | -p PATH NAME | -d NAME... | -t NAME... | NAME...]: the command hash table
+int builtin_hash(const vector<string_view>& tokens, ostream& out, ostream& err){
+    lock_guard<recursive_mutex> lock(command_hash_mutex);
+    // hash: list the table
+    if(tokens.size() == 1){
+        sync_command_hash();
+        if(command_hash.empty()){
+            out<<"hash: hash table empty\n";
+            return 0;
+        }
+        out<<"hits\tcommand\n";
+        for(const auto& [name, entry] : command_hash){
+            out<<"   "<<entry.hits<<"\t"<<entry.path<<"\n";
+        }
+        return 0;
+    }
+    // hash -r: clear the table
+    if(tokens[1] == "-r"){
+        command_hash.clear();
+        return 0;
+    }
+    // hash -p path name: seed an entry without searching PATH
+    if(tokens[1] == "-p"){
+        if(tokens.size() != 4){
+            err<<"hash: usage: hash -p path name\n";
+            return 2;
+        }
+        sync_command_hash();
+        command_hash[string(tokens[3])] = {string(tokens[2]), 0};
+        return 0;
+    }
+    // hash -d name...: forget entries
+    if(tokens[1] == "-d"){
+        int status = 0;
+        for(size_t i=2; i<tokens.size(); i++){
+            if(command_hash.erase(string(tokens[i])) == 0){
+                err<<"hash: "<<tokens[i]<<": not found\n";
+                status = 1;
+            }
+        }
+        return status;
+    }
+    // hash -t name...: print hashed paths
+    if(tokens[1] == "-t"){
+        int status = 0;
+        sync_command_hash();
+        for(size_t i=2; i<tokens.size(); i++){
+            auto it = command_hash.find(string(tokens[i]));
+            if(it == command_hash.end()){
+                err<<"hash: "<<tokens[i]<<": not found\n";
+                status = 1;
+                continue;
+            }
+            out<<it->second.path<<"\n";
+        }
+        return status;
+    }
+    // hash name...: look up and remember
+    int status = 0;
+    for(size_t i=1; i<tokens.size(); i++){
+        if(is_builtin(tokens[i])) continue;
+        string full = find_command(tokens[i]);
+        if(full.empty()){
+            err<<"hash: "<<tokens[i]<<": not found\n";
+            status = 1;
+            continue;
+        }
+        command_hash[string(tokens[i])].hits = 0;
+    }
+    return status;
+}
+
+// set [-o | +o option]: list or change shell options
+int builtin_set(const vector<string_view>& tokens, ostream& out, ostream& err){
+    // set / set -o: list options
+    if(tokens.size() == 1 || (tokens.size() == 2 && tokens[1] == "-o")){
+        for(const auto& opt : shell_options){
+            out<<opt.name<<string(16-strlen(opt.name), ' ')<<(opt.value->load(memory_order_relaxed) ? "on" : "off")<<"\n";
+        }
+        return 0;
+    }
+    if(tokens.size() != 3 || (tokens[1] != "-o" && tokens[1] != "+o")){
+        err<<"set: usage: set [-o|+o option]\n";
+        return 2;
+    }
+    for(auto& opt : shell_options){
+        if(tokens[2] == opt.name){
+            opt.value->store(tokens[1] == "-o", memory_order_relaxed);
+            return 0;
+        }
+    }
+    err<<"set: "<<tokens[2]<<": invalid option name\n";
+    return 1;
+}
+
+// pwd: the current directory
+int builtin_pwd(const vector<string_view>&, ostream& out, ostream&){
+    out<<filesystem::current_path().string()<<"\n";
+    return 0;
+}
+
+// export [-p] [NAME[=VALUE]...]: put variables into the environment of commands; alone, list them
+int builtin_export(const vector<string_view>& tokens, ostream& out, ostream& err){
+    if(tokens.size() > 1 && !(tokens.size() == 2 && tokens[1] == "-p")){
+        int status = 0;
+        for(size_t i=1; i<tokens.size(); i++){
+            if(tokens[i]=="-p") continue;
+            size_t eq = tokens[i].find('=');
+            string_view name = tokens[i].substr(0, eq);
+            if(!is_var_name(name)){
+                err<<"export: `"<<tokens[i]<<"': not a valid identifier\n";
+                status = 1;
+            }
+            else if(eq == string_view::npos) variables.set_exported(name);
+            else variables.set(name, tokens[i].substr(eq+1), true);
+        }
+        return status;
+    }
+    vector<const VariableTable::Var*> exported;
+    variables.for_each([&](const VariableTable::Var& var){
+        if(var.exported) exported.push_back(&var);
+    });
+    sort(exported.begin(), exported.end(), [](auto* a, auto* b){ return a->name < b->name; });
+    for(auto* var : exported) out<<"declare -x "<<var->name<<"=\""<<var->value<<"\"\n";
+    return 0;
+}
+
+// parallel [-j N] [-k] command [args...] [::: input...]
+int builtin_parallel(const vector<string_view>& tokens, ostream& out, ostream& err){
+    return run_parallel(tokens, out, err);
+}
+
+// trace [-c] [FILE]: write the recorded spans as Chrome trace JSON (-c: discard them)
+int builtin_trace(const vector<string_view>& tokens, ostream& out, ostream& err){
+#ifdef SHELL_TRACE
+    if(tokens.size() == 2 && tokens[1] == "-c"){
+        trace_first = trace_next.load();
+        return 0;
+    }
+    if(tokens.size() > 2){
+        err<<"trace: usage: trace [-c] [file]\n";
+        return 2;
+    }
+    if(tokens.size() == 1){
+        out<<trace_json();
+        return 0;
+    }
+    std::ofstream file(tokens[1].data());
+    file<<trace_json();
+    if(!file){
+        err<<"trace: "<<tokens[1]<<": "<<strerror(errno)<<"\n";
+        return 1;
+    }
+    return 0;
+#else
+    (void)tokens;
+    (void)out;
+    err<<"trace: tracing is not compiled in (build with make TRACE=1)\n";
+    return 1;
+#endif
+}
+
+// jobs [-l]: list background and stopped jobs
+int builtin_jobs(const vector<string_view>& tokens, ostream& out, ostream&){
+    bool pids = tokens.size() > 1 && tokens[1] == "-l";
+    for(const auto& job : jobs){
+        if(pids){
+            out<<"["<<job.id<<"]"<<job_marker(job)<<" ";
+            for(pid_t pid : job.live) out<<pid<<" ";
+            out<<(job.stopped ? "Stopped" : "Running")<<"  "<<job.text<<"\n";
+        }
+        else print_job(job, job.stopped ? "Stopped" : "Running", out);
+    }
+    return 0;
+}
+
+// exit [n]: terminate shell
+int builtin_exit(const vector<string_view>& tokens, ostream&, ostream& err){
+    exit_requested = true;
+    if(tokens.size() < 2) return last_status;
+    const char* text = tokens[1].data();
+    char* end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    while(isspace(static_cast<unsigned char>(*end))) end++;
+    if(end == text || *end || errno == ERANGE){
+        err<<"exit: "<<tokens[1]<<": numeric argument required\n";
+        return 2;
+    }
+    return n & 0xff;
+}
+
+// cd [DIR]: change directory ($HOME without DIR)
+int builtin_cd(const vector<string_view>& tokens, ostream& out, ostream&){
+    string path(tokens.size()<2 ? "~" : tokens[1]);
+    const string* home = get_var("HOME");
+    if(path[0]=='~' && !home){
+        out << "cd: HOME not set\n";
+        return 1;
+    }
+    if(path[0]=='~') path = *home;
+    if(chdir(path.c_str()) != 0){
+        out << "cd: " <<path<< ": No such file or directory\n";
+        return 1;
+    }
+    return 0;
+}
+
+// fg / bg [job]: resume a stopped job in the foreground / background
+int builtin_fg_bg(const vector<string_view>& tokens, ostream& out, ostream& err){
+    Job* job = find_job(tokens.size()>1 ? tokens[1] : string_view(), err, tokens[0].data());
+    if(!job) return 1;
+    if(!job_control){
+        err<<tokens[0]<<": no job control\n";
+        return 1;
+    }
+    if(tokens[0]=="fg"){
+        out<<job->text<<"\n";
+        continue_job(*job);
+        job->background = false;
+        return wait_for_job(*job, true);
+    }
+    continue_job(*job);
+    job->background = true;
+    out<<"["<<job->id<<"]"<<job_marker(*job)<<" "<<job->text<<" &\n";
+    return 0;
+}
+
+// wait [%job | pid ...]: wait for the given (default: all) background jobs
+int builtin_wait(const vector<string_view>& tokens, ostream&, ostream& err){
+    int status = 0;
+    if(tokens.size() < 2){
+        vector<int> ids;
+        for(const auto& j : jobs){
+            if(!j.stopped) ids.push_back(j.id);
+        }
+        for(int id : ids){
+            for(auto& j : jobs){
+                if(j.id == id){
+                    wait_for_job(j, false);
+                    break;
+                }
+            }
+        }
+    }
+    for(size_t i=1; i<tokens.size(); i++){
+        Job* job = nullptr;
+        if(tokens[i][0] == '%') job = find_job(tokens[i], err, "wait");
+        else{
+            pid_t pid = atoi(tokens[i].data());
+            for(auto& j : jobs){
+                if(find(j.live.begin(), j.live.end(), pid) != j.live.end()) job = &j;
+            }
+            if(!job) err<<"wait: pid "<<tokens[i]<<" is not a child of this shell\n";
+        }
+        status = job ? wait_for_job(*job, false) : 127;
+    }
+    return status;
+}
+
+// unset NAME...: remove variables
+int builtin_unset(const vector<string_view>& tokens, ostream&, ostream& err){
+    int status = 0;
+    for(size_t i=1; i<tokens.size(); i++){
+        if(tokens[i]=="-v") continue;
+        if(!is_var_name(tokens[i])){
+            err<<"unset: `"<<tokens[i]<<"': not a valid identifier\n";
+            status = 1;
+        }
+        else variables.erase(tokens[i]);
+    }
+    return status;
+}
+
+// Limits known to ulimit, in the order, wording and units of bash's ulimit -a
+struct UlimitResource {
+    char option;
+    int resource;				// -1: pipe size, fixed
+    rlim_t unit;				// bytes (or seconds...) per unit shown and set
+    const char* description;
+    const char* unit_name;		// nullptr: a plain count
+};
+const UlimitResource ulimit_resources[] = {
+#ifdef RLIMIT_RTTIME
+    {'R', RLIMIT_RTTIME, 1, "real-time non-blocking time", "microseconds"},
+#endif
+    {'c', RLIMIT_CORE, 1024, "core file size", "blocks"},
+    {'d', RLIMIT_DATA, 1024, "data seg size", "kbytes"},
+#ifdef RLIMIT_NICE
+    {'e', RLIMIT_NICE, 1, "scheduling priority", nullptr},
+#endif
+    {'f', RLIMIT_FSIZE, 1024, "file size", "blocks"},
+#ifdef RLIMIT_SIGPENDING
+    {'i', RLIMIT_SIGPENDING, 1, "pending signals", nullptr},
+#endif
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory", "kbytes"},
+    {'m', RLIMIT_RSS, 1024, "max memory size", "kbytes"},
+    {'n', RLIMIT_NOFILE, 1, "open files", nullptr},
+    {'p', -1, 512, "pipe size", "512 bytes"},
+#ifdef RLIMIT_MSGQUEUE
+    {'q', RLIMIT_MSGQUEUE, 1, "POSIX message queues", "bytes"},
+#endif
+#ifdef RLIMIT_RTPRIO
+    {'r', RLIMIT_RTPRIO, 1, "real-time priority", nullptr},
+#endif
+    {'s', RLIMIT_STACK, 1024, "stack size", "kbytes"},
+    {'t', RLIMIT_CPU, 1, "cpu time", "seconds"},
+    {'u', RLIMIT_NPROC, 1, "max user processes", nullptr},
+    {'v', RLIMIT_AS, 1024, "virtual memory", "kbytes"},
+#ifdef RLIMIT_LOCKS
+    {'x', RLIMIT_LOCKS, 1, "file locks", nullptr},
+#endif
+};
+
+// Helper: A limit as ulimit shows it: in its units, or "unlimited"
+string ulimit_value(const UlimitResource& limit, bool hard){
+    if(limit.resource < 0) return to_string(PIPE_BUF/limit.unit);
+    struct rlimit rl;
+    if(getrlimit(limit.resource, &rl) < 0) return "unlimited";
+    rlim_t value = hard ? rl.rlim_max : rl.rlim_cur;
+    return value == RLIM_INFINITY ? "unlimited" : to_string(value/limit.unit);
+}
+
+// Helper: One line of ulimit -a: "open files                          (-n) 1024"
+void print_ulimit(const UlimitResource& limit, bool hard, ostream& out){
+    string units = limit.unit_name ? string("(")+limit.unit_name+", -"+limit.option+") " : string("(-")+limit.option+") ";
+    char label[128];
+    snprintf(label, sizeof label, "%-20s %20s", limit.description, units.c_str());
+    out<<label<<ulimit_value(limit, hard)<<"\n";
+}
+
+// Helper: Sets the soft and/or hard limit; the shell's children inherit it
+bool set_ulimit(const UlimitResource& limit, string_view value, bool soft, bool hard, ostream& err){
+    struct rlimit rl;
+    if(limit.resource < 0 || getrlimit(limit.resource, &rl) < 0){
+        err<<"ulimit: "<<limit.description<<": cannot modify limit: "<<strerror(EINVAL)<<"\n";
+        return false;
+    }
+    rlim_t new_limit = 0;
+    if(value == "unlimited") new_limit = RLIM_INFINITY;
+    else if(value == "hard") new_limit = rl.rlim_max;
+    else if(value == "soft") new_limit = rl.rlim_cur;
+    else{
+        bool valid = !value.empty();
+        for(char c : value){
+            if(!isdigit(static_cast<unsigned char>(c)) || new_limit > (RLIM_INFINITY-1)/10) valid = false;
+            else new_limit = new_limit*10 + (c-'0');
+        }
+        if(!valid || new_limit > (RLIM_INFINITY-1)/limit.unit){
+            err<<"ulimit: "<<value<<": invalid number\n";
+            return false;
+        }
+        new_limit *= limit.unit;
+    }
+    if(soft) rl.rlim_cur = new_limit;
+    if(hard) rl.rlim_max = new_limit;
+    if(setrlimit(limit.resource, &rl) < 0){
+        err<<"ulimit: "<<limit.description<<": cannot modify limit: "<<strerror(errno)<<"\n";
+        return false;
+    }
+    return true;
+}
+
+// ulimit [-SHa] [-cdefilmnpqrstuvxR]... [LIMIT | unlimited | hard | soft]: show or set resource limits
+int builtin_ulimit(const vector<string_view>& tokens, ostream& out, ostream& err){
+    bool soft = false, hard = false, all = false;
+    vector<const UlimitResource*> chosen;
+    size_t i = 1;
+    for(; i<tokens.size() && tokens[i].size() > 1 && tokens[i][0] == '-'; i++){
+        if(tokens[i] == "--"){
+            i++;
+            break;
+        }
+        for(char c : tokens[i].substr(1)){
+            const UlimitResource* found = nullptr;
+            for(const auto& limit : ulimit_resources){
+                if(limit.option == c) found = &limit;
+            }
+            if(c == 'S') soft = true;
+            else if(c == 'H') hard = true;
+            else if(c == 'a') all = true;
+            else if(found) chosen.push_back(found);
+            else{
+                err<<"ulimit: -"<<c<<": invalid option\n"
+                   <<"ulimit: usage: ulimit [-SHacdefilmnpqrstuvxR] [limit]\n";
+                return 2;
+            }
+        }
+    }
+    // shown: the soft limit unless only -H is given; set: both unless -S or -H says which
+    bool show_hard = hard && !soft;
+    if(all){
+        for(const auto& limit : ulimit_resources) print_ulimit(limit, show_hard, out);
+        return 0;
+    }
+    if(chosen.empty()){
+        for(const auto& limit : ulimit_resources){
+            if(limit.option == 'f') chosen.push_back(&limit);
+        }
+    }
+    if(i == tokens.size()){
+        for(const UlimitResource* limit : chosen){
+            if(chosen.size() > 1) print_ulimit(*limit, show_hard, out);
+            else out<<ulimit_value(*limit, show_hard)<<"\n";
+        }
+        return 0;
+    }
+    if(!soft && !hard) soft = hard = true;
+    int status = 0;
+    for(const UlimitResource* limit : chosen){
+        if(!set_ulimit(*limit, tokens[i], soft, hard, err)) status = 1;
+    }
+    return status;
+}
+
+static deque<string> loaded_names;		// registry keys of builtins loaded with enable -f
+
+// Helper: enable -f FILE NAME: registers NAME_builtin from the shared object FILE
+bool load_builtin(string_view file, string_view name, ostream& err){
+    void* library = dlopen(string(file).c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!library){
+        err<<"enable: cannot open shared object "<<file<<": "<<dlerror()<<"\n";
+        return false;
+    }
+    string symbol = string(name)+"_builtin";
+    auto* utility = static_cast<const shell_builtin*>(dlsym(library, symbol.c_str()));
+    if(!utility || !utility->run){
+        err<<"enable: cannot find "<<symbol<<" in shared object "<<file<<"\n";
+        dlclose(library);
+        return false;
+    }
+    if(utility->abi_version != SHELL_BUILTIN_ABI_VERSION){
+        err<<"enable: "<<name<<": builtin ABI version "<<utility->abi_version<<", expected "<<SHELL_BUILTIN_ABI_VERSION<<"\n";
+        dlclose(library);
+        return false;
+    }
+    // the library stays loaded: a running pipeline may still be calling into it
+    auto it = builtin_table.find(name);
+    if(it == builtin_table.end()){
+        loaded_names.emplace_back(name);
+        it = builtin_table.emplace(loaded_names.back(), Builtin()).first;
+    }
+    it->second = Builtin();
+    it->second.utility = utility;
+    return true;
+}
+
+/* enable [-n] [NAME...] | enable -f FILE NAME...: turn builtins on or
+   off (enable -n cat runs /bin/cat again) or load new ones; alone,
+   list the enabled (with -n, the disabled) ones */
+int builtin_enable(const vector<string_view>& tokens, ostream& out, ostream& err){
+    bool disable = false;
+    string_view file;
+    size_t i = 1;
+    for(; i<tokens.size() && tokens[i].size() > 1 && tokens[i][0]=='-'; i++){
+        if(tokens[i] == "-n") disable = true;
+        else if(tokens[i] == "-f" && i+1 < tokens.size()) file = tokens[++i];
+        else{
+            err<<"enable: usage: enable [-n] [-f file] [name ...]\n";
+            return 2;
+        }
+    }
+    if(i == tokens.size()){
+        vector<string_view> names;
+        for(const auto& [name, builtin] : builtin_table){
+            if(builtin.enabled != disable) names.push_back(name);
+        }
+        sort(names.begin(), names.end());
+        for(auto name : names) out<<"enable "<<(disable ? "-n " : "")<<name<<"\n";
+        return 0;
+    }
+    int status = 0;
+    for(; i<tokens.size(); i++){
+        if(!file.empty()){
+            if(!load_builtin(file, tokens[i], err)) status = 1;
+            continue;
+        }
+        auto it = builtin_table.find(tokens[i]);
+        if(it == builtin_table.end()){
+            err<<"enable: "<<tokens[i]<<": not a shell builtin\n";
+            status = 1;
+            continue;
+        }
+        it->second.enabled = !disable;
+    }
+    return status;
+}
+
+// Helper: Fills the builtin registry; run once at startup
+void register_builtins(){
+    struct { const char* name; BuiltinHandler run; bool changes_shell; } shell_builtins[] = {
+        {"echo", builtin_echo, false}, {"type", builtin_type, false}, {"pwd", builtin_pwd, false},
+        {"history", builtin_history, false}, {"hash", builtin_hash, false}, {"set", builtin_set, false},
+        {"jobs", builtin_jobs, false}, {"parallel", builtin_parallel, false}, {"trace", builtin_trace, false},
+        {"exit", builtin_exit, true}, {"cd", builtin_cd, true}, {"fg", builtin_fg_bg, true}, {"bg", builtin_fg_bg, true},
+        {"wait", builtin_wait, true}, {"export", builtin_export, true}, {"unset", builtin_unset, true},
+        {"enable", builtin_enable, true}, {"ulimit", builtin_ulimit, true},
+    };
+    for(const auto& b : shell_builtins){
+        Builtin& entry = builtin_table[b.name];
+        entry.run = b.run;
+        entry.changes_shell = b.changes_shell;
+    }
+    for(const auto& utility : bundled_utilities) builtin_table[utility.name].utility = &utility;
+}
+
+// Helper: Runs a shell builtin
+int execute_builtin(const vector<string_view>& tokens, ostream& out, ostream& err){
+    return find_builtin(tokens[0])->run(tokens, out, err);
+}
+
+// ------------------------------------------------------------
+// Multi command (|) pipeline execution
+// ------------------------------------------------------------
+/* Helper:
+		Text of a here-document as it runs: with an unquoted delimiter,
+		$ references, $(...) and `...` are expanded (never split or
+		globbed) and \$ \` \\ and \newline are escapes; otherwise the
+		body as written. */
+string heredoc_text(const HereDoc& doc){
+    if(!doc.expand) return doc.body;
+    const string& body = doc.body;
+    size_t n = body.size();
+    string marked;
+    marked.reserve(n);
+    for(size_t i=0; i<n; ){
+        char c = body[i];
+        if(c=='\\' && i+1<n && (body[i+1]=='$' || body[i+1]=='`' || body[i+1]=='\\')){
+            marked += body[i+1];
+            i += 2;
+        }
+        else if(c=='\\' && i+1<n && body[i+1]=='\n') i += 2;
+        else if(starts_substitution(body.data(), i, n)){
+            bool backquoted = c=='`';
+            size_t start = backquoted ? i+1 : i+2;
+            size_t close = backquoted ? body.find('`', start) : find_substitution_end(body.data(), start, n);
+            if(close == string::npos || close >= n){
+                marked += body[i++];
+                continue;
+            }
+            marked += SUBST_QUOTED;
+            marked.append(body, start, close-start);
+            marked += SUBST_END;
+            i = close+1;
+        }
+        else if(c=='$' && i+1<n && starts_parameter(body[i+1])){
+            marked += EXPAND_QUOTED;
+            i++;
+        }
+        else marked += body[i++];
+    }
+    vector<string> fields;
+    expand_word(marked, false, fields);
+    return fields.empty() ? "" : fields[0];
+}
+
+/* Here-document and here-string text never touches the filesystem.
+   Payloads that fit the pipe's capacity are written into a pipe up
+   front, so the write can't block. The capacity is asked for rather
+   than assumed: past the per-user pipe limit Linux hands out pipes of
+   a single page. Larger payloads go into a memfd sealed against
+   further writes and resizing, which the command reads like a file. */
+const size_t TEXT_PIPE_MAX = 16384;
+
+// Helper: How much a fresh pipe holds before a write blocks
+size_t pipe_capacity(int fd){
+#ifdef F_GETPIPE_SZ
+    int size = fcntl(fd, F_GETPIPE_SZ);
+    return size > 0 ? size : PIPE_BUF;
+#else
+    (void)fd;
+    return PIPE_BUF;		// all POSIX promises
+#endif
+}
+
+// Helper: A descriptor to read text from, positioned at its start (-1 on failure)
+int text_input_fd(const string& text){
+    int fds[2] = {-1, -1};
+    if(text.size() <= TEXT_PIPE_MAX){
+        if(pipe(fds) == -1) return -1;
+        if(text.size() > pipe_capacity(fds[1])){
+            close(fds[0]);
+            close(fds[1]);
+            fds[0] = -1;
+        }
+    }
+    if(fds[0] >= 0){
+        bool ok = write_all(fds[1], text.data(), text.size());
+        close(fds[1]);
+        if(!ok){
+            close(fds[0]);
+            return -1;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        return fds[0];
+    }
+#ifdef __linux__
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    // no memfd: an already unlinked temporary file
+    char path[] = "/tmp/shell-heredoc-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd >= 0){
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if(fd < 0) return -1;
+    if(!write_all(fd, text.data(), text.size())){
+        close(fd);
+        return -1;
+    }
+#ifdef __linux__
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/* Helper:
+		Opens a stage's redirection targets in order (the last one per
+		fd wins): files for > >> <, in-memory text for << <<- <<<. */
+bool open_redirections(const CommandLine& line, const vector<Redirection>& redirs, int& in_fd, int& out_fd, int& err_fd){
+    if(redirs.empty()) return true;
+    TRACE_SPAN("redirect");
+    for(const auto& r : redirs){
+        int fd;
+        if(r.op == RedirectOp::READ) fd = open(r.target.data(), O_RDONLY | O_CLOEXEC);
+        else if(r.op == RedirectOp::HERESTRING) fd = text_input_fd(string(r.target)+"\n");
+        else if(r.heredoc >= 0) fd = text_input_fd(heredoc_text(line.heredocs[r.heredoc]));
+        else fd = open(r.target.data(), O_WRONLY | O_CREAT | O_CLOEXEC | (r.op==RedirectOp::APPEND ? O_APPEND : O_TRUNC), 0644);
+        if(fd<0){
+            if(r.op == RedirectOp::READ) perror(r.target.data());
+            else perror("open");
+            return false;
+        }
+        int& slot = is_input_redirection(r.op) ? in_fd : r.fd==2 ? err_fd : out_fd;
+        if(slot>=0) close(slot);
+        slot = fd;
+    }
+    return true;
+}
+
+// Helper: Builtins that act on the shell itself (the rest only produce output)
+bool changes_shell_state(const vector<string_view>& tokens){
+    const Builtin* builtin = find_builtin(tokens[0]);
+    if(!builtin || !builtin->changes_shell) return false;
+    return !(tokens[0]=="export" && (tokens.size()==1 || (tokens.size()==2 && tokens[1]=="-p")));
+}
+
+/* Helper:
+		set, hash, history and trace list without arguments but with them
+		change settings; as a pipeline stage or in $(...) they act on a
+		subshell, which keeps the change to itself. */
+bool changes_settings(const vector<string_view>& argv){
+    static const unordered_set<string_view> settings = {"set", "hash", "history", "trace"};
+    return argv.size() > 1 && settings.count(argv[0]);
+}
+
+/* Helper:
+		Stages the shell runs itself rather than spawning: builtins, and
+		utilities that accept their arguments. A utility that would read
+		a terminal (in_fd) is left to the real command, which Ctrl-C can
+		stop. */
+bool runs_in_shell(const vector<string_view>& argv, int in_fd){
+    const Builtin* builtin = find_builtin(argv[0]);
+    if(!builtin) return false;
+    if(builtin->run) return true;
+    auto args = make_argv(argv);
+    int mode = builtin->utility->accepts ? builtin->utility->accepts(argv.size(), args.data()) : SHELL_BUILTIN_ACCEPT_STDIN;
+    return mode == SHELL_BUILTIN_ACCEPT || (mode == SHELL_BUILTIN_ACCEPT_STDIN && !isatty(in_fd));
+}
+
+// Helper: In-shell stages that read stdin; in a pipeline they get a process of their own
+bool reads_stdin(const vector<string_view>& argv){
+    return argv[0]=="parallel";
+}
+
+/* Helper:
+		Runs an in-shell stage with its input on in_fd and output on
+		out_fd / err_fd (-1 = the shell's own). Builtin output is
+		collected in one buffer and written in large chunks rather than
+		per line; utilities work on the descriptors directly. */
+int run_in_shell(const vector<string_view>& argv, int in_fd, int out_fd, int err_fd){
+    TRACE_SPAN("builtin", argv[0]);
+    if(out_fd < 0){
+        flush_output();
+        out_fd = STDOUT_FILENO;
+    }
+    const Builtin* builtin = find_builtin(argv[0]);
+    if(!builtin->run){
+        auto args = make_argv(argv);
+        return builtin->utility->run(argv.size(), args.data(), in_fd >= 0 ? in_fd : STDIN_FILENO, out_fd, err_fd >= 0 ? err_fd : STDERR_FILENO);
+    }
+    if(err_fd >= 0){
+        FdOutBuf err_buf(err_fd, 4096);
+        ostream err(&err_buf);
+        FdOutBuf out_buf(out_fd);
+        ostream out(&out_buf);
+        return execute_builtin(argv, out, err);
+    }
+    FdOutBuf out_buf(out_fd);
+    ostream out(&out_buf);
+    return execute_builtin(argv, out, cerr);
+}
+
+/* Helper:
+		Forks a copy of the shell that runs body (a ( subshell ), an
+		and-or list sent to the background, a command substitution) and
+		exits with its $?. The copy is a plain non-interactive shell: no
+		prompts, job table or terminal handoff of its own. */
+template<class F>
+pid_t fork_shell(const SpawnIO& io, F body){
+    flush_output();
+    pid_t pid = fork();
+    if(pid == 0){
+        apply_spawn_io(io);
+        interactive = false;
+        job_control = false;
+        jobs.clear();
+        metrics_fd = -1;
+        session_cgroup = -1;		// what it starts stays in the cgroup it runs in
+        body();
+        flush_output();
+        _exit(last_status);
+    }
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(io.pgid >= 0) setpgid(pid, io.pgid ? io.pgid : pid);
+    return pid;
+}
+
+// Helper: Runs an in-shell stage in a forked child, for background jobs that must not block the shell
+pid_t fork_in_shell(const Stage& stage, const SpawnIO& io){
+    return fork_shell(io, [&](){
+        assign_variables(stage.assigns);
+        last_status = run_in_shell(stage.argv, -1, -1, -1);
+    });
+}
+
+void execute_list(const CommandLine& line, int index);
+
+/* Runs one job: a single command or a pipeline, in the foreground or
+   (trailing &) in the background. Under job control every job gets its
+   own process group, and a foreground job the terminal. Returns the
+   status of the last stage; a background job counts as started (0). */
+int execute_pipeline_multi(const CommandLine& line, const vector<Stage>& stages, bool background, bool timed, const string& text) {
+    TRACE_SPAN("pipeline", text);
+    int n = stages.size();
+
+    // Create N-1 pipes
+    vector<vector<int>> pipes(n-1, vector<int>(2));
+    for(int i=0; i<n-1; i++){
+        if(pipe(pipes[i].data()) == -1){
+            perror("pipe");
+            return 1;
+        }
+    }
+
+    // Per-stage redirections override the pipe ends; a stage whose targets can't be opened doesn't run
+    vector<int> in_fds(n, -1), out_fds(n, -1), err_fds(n, -1);
+    vector<bool> runs(n, true);
+    for(int i=0; i<n; i++){
+        runs[i] = open_redirections(line, stages[i].redirs, in_fds[i], out_fds[i], err_fds[i]) && (!stages[i].argv.empty() || stages[i].subshell >= 0);
+    }
+
+    // Without job control a background job must not compete for the shell's stdin
+    int null_fd = -1;
+    if(background && !job_control) null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // Prefix assignments (NAME=value cmd) only reach that command's environment
+    vector<vector<string>> stage_env(n);
+    vector<vector<char*>> stage_envp(n);
+    for(int i=0; i<n; i++){
+        if(stages[i].assigns.empty() || !runs[i]) continue;
+        stage_env[i] = command_environment(stages[i].assigns);
+        for(auto& entry : stage_env[i]) stage_envp[i].push_back(entry.data());
+        stage_envp[i].push_back(nullptr);
+    }
+
+    Job& job = create_job(text, background);
+    job.timed = timed;
+    int job_id = job.id;
+
+    auto stage_io = [&](int i){
+        SpawnIO io;
+        if(i>0) io.in = pipes[i-1][0];		// stdin from previous pipe
+        else io.in = null_fd;
+        if(in_fds[i]>=0) io.in = in_fds[i];
+        if(i<n-1) io.out = pipes[i][1];		// stdout to next pipe
+        if(out_fds[i]>=0) io.out = out_fds[i];
+        if(err_fds[i]>=0) io.err = err_fds[i];
+        for(auto& p : pipes){
+            io.close_fds.push_back(p[0]);
+            io.close_fds.push_back(p[1]);
+        }
+        io.pgid = job_spawn_pgid(job);
+        io.cgroup = job_spawn_cgroup(job);
+        if(job_control && !background) io.tty = STDIN_FILENO;
+        if(!stage_envp[i].empty()) io.envp = stage_envp[i].data();
+        return io;
+    };
+
+    /* Foreground builtins and accepting utilities run in-process (see
+       below); a utility that would read a terminal doesn't qualify, and
+       neither do stages reading their stdin as a whole shell would.
+       Under job control a utility on a pipe runs the real command: the
+       shell blocked in read() or write() on a pipe whose other end got
+       stopped with Ctrl-Z could never get back to its prompt. A stage
+       with NAME=value prefixes runs alone or in a process of its own,
+       since its temporary variables mustn't show to the other stages,
+       and so does a builtin that changes the shell (cd, export, ulimit,
+       set -o ...): as a pipeline stage it only changes its own subshell. */
+    vector<bool> in_shell(n, false);
+    vector<int> stage_in(n, STDIN_FILENO);
+    for(int i=0; i<n && !background; i++){
+        if(in_fds[i] >= 0) stage_in[i] = in_fds[i];
+        else if(i > 0) stage_in[i] = pipes[i-1][0];
+        bool on_pipe = (i > 0 && in_fds[i] < 0) || (i < n-1 && out_fds[i] < 0);
+        bool utility = !is_builtin(stages[i].argv.empty() ? "" : stages[i].argv[0]);
+        in_shell[i] = runs[i] && stages[i].subshell < 0 && runs_in_shell(stages[i].argv, stage_in[i]) && !reads_stdin(stages[i].argv)
+                      && !(job_control && on_pipe && utility)
+                      && (n == 1 || (stages[i].assigns.empty() && !changes_shell_state(stages[i].argv) && !changes_settings(stages[i].argv)));
+    }
+
+    /* External stages first, so no pipe fd is closed under a spawn in
+       progress. In a background job builtins are forked as well, since
+       the shell can't wait for them, and so are those reading their
+       stdin. ( subshells ) always run in a forked shell. */
+    pid_t last_pid = -1;
+    int last_failure = 127;
+    for(int i=0; i<n; i++){
+        if(!runs[i] || in_shell[i]) continue;
+        pid_t pid;
+        if(stages[i].subshell >= 0){
+            pid = fork_shell(stage_io(i), [&](){ execute_list(line, stages[i].subshell); });
+        }
+        else if(is_builtin(stages[i].argv[0])) pid = fork_in_shell(stages[i], stage_io(i));
+        else{
+            pid = spawn_command(stages[i].argv, stage_io(i));
+            if(pid < 0 && i == n-1) last_failure = spawn_failure_status;
+        }
+        if(pid > 0) add_job_process(job, pid);
+        if(i == n-1) last_pid = pid;
+    }
+
+    /* In-process stages: the last one in the shell itself, the others on
+       threads writing straight into their pipe (or redirection target).
+       Each keeps the read end of the pipe feeding it until it's done, so
+       a utility can read it and the writer sees EPIPE only afterwards;
+       a thread also owns (and closes) its pipe's write end. */
+    vector<thread> workers;
+    vector<bool> owned_by_worker(n, false);
+    for(int i=0; i<n-1; i++){
+        if(!in_shell[i]) continue;
+        owned_by_worker[i] = out_fds[i] < 0;
+        int in = stage_in[i];
+        int fd = out_fds[i] >= 0 ? out_fds[i] : pipes[i][1];
+        int err_fd = err_fds[i];
+        bool owned = owned_by_worker[i];
+        bool owns_in = i > 0 && in_fds[i] < 0;
+        workers.emplace_back([&stages, i, in, fd, err_fd, owned, owns_in](){
+            run_in_shell(stages[i].argv, in, fd, err_fd);
+            if(owned) close(fd);
+            if(owns_in) close(in);
+        });
+    }
+
+    // ---------- PARENT ----------
+    for(int i=0; i<n-1; i++){
+        if(!in_shell[i+1] || in_fds[i+1] >= 0) close(pipes[i][0]);
+        if(!owned_by_worker[i]) close(pipes[i][1]);
+    }
+    if(null_fd >= 0) close(null_fd);
+
+    // pipeline status is the status of its last stage
+    int status = 0;
+    bool in_shell_last = in_shell[n-1];
+    if(in_shell_last){
+        auto saved = assign_temporarily(stages[n-1].assigns);
+        status = run_in_shell(stages[n-1].argv, stage_in[n-1], out_fds[n-1], err_fds[n-1]);
+        restore_variables(saved);
+        if(n > 1 && in_fds[n-1] < 0) close(stage_in[n-1]);
+    }
+
+    for(auto& t : workers){
+        t.join();
+    }
+    for(int i=0; i<n; i++){
+        if(in_fds[i]>=0) close(in_fds[i]);
+        if(out_fds[i]>=0) close(out_fds[i]);
+        if(err_fds[i]>=0) close(err_fds[i]);
+    }
+
+    if(background){
+        if(job.live.empty()){
+            release_job_cgroup(job, false);
+            jobs.remove_if([job_id](const Job& j){ return j.id == job_id; });
+            return 1;
+        }
+        last_background_pid = job.last_pid;
+        if(interactive) cout<<"["<<job.id<<"] "<<job.last_pid<<"\n";
+        return 0;
+    }
+
+    int job_status = wait_for_job(job, true);
+    if(!runs[n-1]) status = stages[n-1].argv.empty() && stages[n-1].subshell < 0 ? 0 : 1;
+    else if(!in_shell_last) status = last_pid > 0 ? job_status : last_failure;
+    else if(job_status == 128+SIGINT) status = job_status;		// Ctrl-C ended the stages feeding it
+    return status;
+}
+
+// ------------------------------------------------------------
+// Execute one input line
+// ------------------------------------------------------------
+void execute_pipeline(const CommandLine& line, const Pipeline& pipeline, bool background, const string& text);
+
+void run_line(const string& input){
+    TRACE_SPAN("line", input);
+    // Collect background jobs that finished since the last line
+    reap_jobs(interactive);
+
+    // Tokenize and parse input (or reuse an earlier parse of the same text)
+    shared_ptr<const CommandLine> line = parse_cached(input);
+    if(!line->error.empty()){
+        cerr<<line->error<<"\n";
+        last_status = 2;
+        return;
+    }
+
+    //empty input: new input req.
+    const auto& items = line->lists[0].items;
+    if(items.empty()){
+        return;
+    }
+
+    if(metrics_fd < 0){
+        execute_list(*line, 0);
+        return;
+    }
+
+    // One metrics record per line; background jobs are logged when they finish
+    Usage usage;
+    double real = measure(usage, [&](){ execute_list(*line, 0); });
+    bool all_background = all_of(items.begin(), items.end(), [](const AndOr& item){ return item.background; });
+    if(!all_background) log_metrics(input, last_status, real, usage, false);
+}
+
+// Helper: a && b & : the whole and-or list runs as one job, in a forked shell
+void start_background_list(const CommandLine& line, const AndOr& item);
+
+// Helper: Runs a pipeline in the foreground, reporting its resource use under the time keyword
+void run_pipeline(const CommandLine& line, const Pipeline& pipeline){
+    if(!pipeline.timed){
+        execute_pipeline(line, pipeline, false, pipeline.text);
+        return;
+    }
+    Usage usage;
+    double real = measure(usage, [&](){ execute_pipeline(line, pipeline, false, pipeline.text); });
+    print_time_report(real, usage);
+}
+
+// Helper: pipeline && pipeline || ...: each one runs only if the status so far calls for it
+void execute_and_or(const CommandLine& line, const AndOr& item){
+    for(size_t k=0; k<item.pipelines.size() && !exit_requested; k++){
+        if(k > 0 && item.and_ops[k-1] != (last_status == 0)) continue;
+        run_pipeline(line, item.pipelines[k]);
+    }
+}
+
+/* Runs line.lists[index]: the line itself or a ( subshell ) body. A
+   foreground command killed by Ctrl-C ends the rest of the list, as in
+   other shells. */
+void execute_list(const CommandLine& line, int index){
+    for(const AndOr& item : line.lists[index].items){
+        if(exit_requested) break;
+        if(!item.background){
+            execute_and_or(line, item);
+            if(interactive && last_status == 128+SIGINT) break;
+        }
+        else if(item.pipelines.size() == 1) execute_pipeline(line, item.pipelines[0], true, item.text);
+        else start_background_list(line, item);
+    }
+}
+
+void start_background_list(const CommandLine& line, const AndOr& item){
+    Job& job = create_job(item.text, true);
+    int job_id = job.id;
+    SpawnIO io;
+    io.pgid = job_spawn_pgid(job);
+    io.cgroup = job_spawn_cgroup(job);
+    // Without job control a background job must not compete for the shell's stdin
+    if(!job_control) io.in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pid_t pid = fork_shell(io, [&](){ execute_and_or(line, item); });
+    if(io.in >= 0) close(io.in);
+    if(pid < 0){
+        release_job_cgroup(job, false);
+        jobs.remove_if([job_id](const Job& j){ return j.id == job_id; });
+        last_status = 1;
+        return;
+    }
+    add_job_process(job, pid);
+    last_background_pid = pid;
+    if(interactive) cout<<"["<<job.id<<"] "<<pid<<"\n";
+    last_status = 0;
+}
+
+// Helper: Runs one pipeline; single foreground builtins run in the shell itself
+void execute_pipeline(const CommandLine& line, const Pipeline& pipeline, bool background, const string& text){
+    // ------------------------------------------------------------
+    // Parameter expansion, on a copy so the parsed line is left intact
+    // ------------------------------------------------------------
+    deque<string> expanded_words;
+    vector<Stage> expanded_stages;
+    substitution_ran = false;
+    if(line.expands){
+        TRACE_SPAN("expand");
+        // The globs of one pipeline share directory listings; an earlier command may have changed them
+        clear_dir_cache();
+        expanded_stages.reserve(pipeline.stages.size());
+        for(const auto& stage : pipeline.stages) expanded_stages.push_back(expand_stage(stage, expanded_words));
+    }
+    const vector<Stage>& stages = line.expands ? expanded_stages : pipeline.stages;
+
+    // ------------------------------------------------------------
+    // Jobs: pipelines (cmd1 | cmd2), background commands (cmd &) and
+    // external commands; only foreground builtins run below
+    // ------------------------------------------------------------
+    // (a builtin that reads stdin gets a process of its own when stdin is redirected)
+    const vector<string_view>& tokens = stages[0].argv;
+    bool stdin_redirected = any_of(stages[0].redirs.begin(), stages[0].redirs.end(), [](const Redirection& r){ return is_input_redirection(r.op); });
+    if(stages.size() > 1 || background || stages[0].subshell >= 0 || (!tokens.empty() && (!is_builtin(tokens[0]) || (stdin_redirected && reads_stdin(tokens))))){
+        last_status = execute_pipeline_multi(line, stages, background, pipeline.timed, text);
+        return;
+    }
+
+    // NAME=value with no command sets shell variables
+    if(tokens.empty()) assign_variables(stages[0].assigns);
+
+    // ------------------------------------------------------------
+    // Open Redirection targets (in order; the last one per fd wins)
+    // ------------------------------------------------------------
+    int in_fd = -1;
+    int out_fd = -1;
+    int err_fd = -1;
+    bool redirect_failed = !open_redirections(line, stages[0].redirs, in_fd, out_fd, err_fd);
+    if(in_fd>=0) close(in_fd);		// the remaining builtins don't read stdin
+
+    if(redirect_failed || tokens.empty()){
+        if(out_fd>=0) close(out_fd);
+        if(err_fd>=0) close(err_fd);
+        // NAME=$(cmd) alone: the status of the substitution
+        last_status = redirect_failed ? 1 : (substitution_ran ? last_status : 0);
+        return;
+    }
+
+    // ------------------------------------------------------------
+    // Output-only builtins (echo, pwd, history, type, hash, set, jobs,
+    // export listing) write through one buffer straight into their targets
+    // ------------------------------------------------------------
+    // NAME=value prefixes hold only while the builtin runs
+    auto saved = assign_temporarily(stages[0].assigns);
+    if(!changes_shell_state(tokens)){
+        last_status = run_in_shell(tokens, -1, out_fd, err_fd);
+        restore_variables(saved);
+        if(out_fd>=0) close(out_fd);
+        if(err_fd>=0) close(err_fd);
+        return;
+    }
+
+    // ------------------------------------------------------------
+    // Apply Redirection to the shell itself for the rest (save original FDs)
+    // ------------------------------------------------------------
+    int saved_stdout = -1;
+    int saved_stderr = -1;
+
+    flush_output();
+    if(out_fd>=0){
+        saved_stdout = dup(STDOUT_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    if(err_fd>=0){
+        saved_stderr = dup(STDERR_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+    }
+
+    // ------------------------------------------------------------
+    // Built-in Command Handling
+    // ------------------------------------------------------------
+
+    last_status = execute_builtin(tokens, cout, cerr);
+    restore_variables(saved);
+
+    if(out_fd>=0) close(out_fd);
+    if(err_fd>=0) close(err_fd);
+
+    // ------------------------------------------------------------
+    // Restore Original stdout and stderr
+    // ------------------------------------------------------------
+    if(saved_stdout>=0 || saved_stderr>=0) flush_output();
+    if(saved_stdout>=0){
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if(saved_stderr>=0){
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+}
+
+// ------------------------------------------------------------
+// Command substitution ($(...) and `...`)
+// ------------------------------------------------------------
+// Helper: Drops the trailing newlines of captured output
+void strip_trailing_newlines(string& text){
+    while(!text.empty() && text.back() == '\n') text.pop_back();
+}
+
+// Helper: Builtins $(...) may evaluate in the shell itself: those that leave it as it was
+bool substitutes_in_shell(const vector<string_view>& argv){
+    const Builtin* builtin = find_builtin(argv[0]);
+    return builtin && builtin->run && !builtin->changes_shell && !changes_settings(argv);
+}
+
+/* Helper:
+		Output of a substituted command, without trailing newlines. A
+		single output-only builtin (echo, pwd, type, ...) is evaluated
+		in-process into a string; anything else runs in a forked copy
+		of the shell whose stdout is a pipe, read into a buffer that
+		doubles as it fills. $? becomes the command's status. */
+string command_output(const string& text){
+    TRACE_SPAN("substitution", text);
+    substitution_ran = true;
+
+    // ---------- fast path: one builtin, no fork ----------
+    shared_ptr<const CommandLine> line = parse_cached(text);
+    if(!line->error.empty()){
+        cerr<<line->error<<"\n";
+        last_status = 2;
+        return "";
+    }
+    const auto& items = line->lists[0].items;
+    if(items.empty()){
+        last_status = 0;
+        return "";
+    }
+    const Pipeline& first = items[0].pipelines[0];
+    if(items.size() == 1 && items[0].pipelines.size() == 1 && !items[0].background && !first.timed && first.stages.size() == 1
+       && first.stages[0].subshell < 0 && first.stages[0].redirs.empty() && first.stages[0].assigns.empty()){
+        deque<string> storage;
+        Stage stage = line->expands ? expand_stage(first.stages[0], storage) : first.stages[0];
+        if(!stage.argv.empty() && substitutes_in_shell(stage.argv)){
+            ostringstream out;
+            last_status = execute_builtin(stage.argv, out, cerr);
+            string output = out.str();
+            strip_trailing_newlines(output);
+            return output;
+        }
+    }
+
+    // ---------- a forked shell runs the line into a pipe ----------
+    int fds[2];
+    if(pipe(fds) == -1){
+        perror("pipe");
+        last_status = 1;
+        return "";
+    }
+    SpawnIO io;
+    io.out = fds[1];
+    io.close_fds = {fds[0], fds[1]};
+    pid_t pid = fork_shell(io, [&](){ execute_list(*line, 0); });
+    close(fds[1]);
+    if(pid < 0){
+        close(fds[0]);
+        last_status = 1;
+        return "";
+    }
+
+    string output(4096, '\0');
+    size_t used = 0;
+    for(;;){
+        if(used == output.size()) output.resize(output.size()*2);
+        ssize_t n = read(fds[0], &output[used], output.size()-used);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        used += n;
+    }
+    close(fds[0]);
+    output.resize(used);
+    strip_trailing_newlines(output);
+
+    int wstatus = 0;
+    struct rusage ru;
+    while(wait4(pid, &wstatus, 0, &ru) < 0 && errno == EINTR){}
+    command_usage.add(ru);
+    last_status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+    return output;
+}
+
+// ------------------------------------------------------------
+// Non-interactive input (-c string, script file, piped stdin)
+// ------------------------------------------------------------
+/* Reads lines from a descriptor in large blocks. When the descriptor is
+   the shell's own stdin and seekable (shell < script), the file offset
+   is put back to the end of each returned line so commands that read
+   stdin see the rest of the script, as in other shells. */
+class LineReader {
+public:
+    LineReader(int fd, bool share_offset) : fd(fd), buf(1 << 16) {
+        sync_offset = share_offset && lseek(fd, 0, SEEK_CUR) >= 0;
+    }
+
+    bool next(string& line){
+        while(true){
+            char* nl = static_cast<char*>(memchr(buf.data()+pos, '\n', len-pos));
+            if(nl){
+                size_t end = nl-buf.data();
+                line.assign(buf.data()+pos, end-pos);
+                pos = end+1;
+                if(sync_offset){
+                    lseek(fd, -static_cast<off_t>(len-pos), SEEK_CUR);
+                    pos = len = 0;
+                }
+                return true;
+            }
+            if(eof){
+                if(pos == len) return false;
+                line.assign(buf.data()+pos, len-pos);
+                pos = len;
+                return true;
+            }
+            // compact, grow if a single line fills the buffer, then refill
+            memmove(buf.data(), buf.data()+pos, len-pos);
+            len -= pos;
+            pos = 0;
+            if(len == buf.size()) buf.resize(buf.size()*2);
+            ssize_t r = read(fd, buf.data()+len, buf.size()-len);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) eof = true;
+            else len += r;
+        }
+    }
+
+private:
+    int fd;
+    vector<char> buf;
+    size_t pos = 0;
+    size_t len = 0;
+    bool eof = false;
+    bool sync_offset = false;
+};
+
+// Helper: Runs every line of a -c string
+void run_string(const string& text){
+    size_t start = 0;
+    // here-document bodies are taken from the same lines
+    next_input_line = [&](string& line){
+        if(start > text.size()) return false;
+        size_t end = text.find('\n', start);
+        if(end == string::npos) end = text.size();
+        line = text.substr(start, end-start);
+        start = end+1;
+        return true;
+    };
+    string line;
+    while(!exit_requested && next_input_line(line)){
+        run_line(line);
+    }
+    next_input_line = nullptr;
+}
+
+// Helper: Runs every line read from fd
+void run_stream(int fd, bool share_offset){
+    LineReader reader(fd, share_offset);
+    next_input_line = [&](string& line){ return reader.next(line); };
+    string line;
+    while(!exit_requested && reader.next(line)){
+        run_line(line);
+    }
+    next_input_line = nullptr;
+}
+
+// ------------------------------------------------------------
+// Session recording (SHELL_RECORD=FILE, shell --cast FILE)
+// ------------------------------------------------------------
+/* With SHELL_RECORD=FILE the shell splits in two at startup, like
+   script(1): the session runs in a child whose terminal is a new pty
+   (or, without a terminal, whose stdout and stderr are pipes), and the
+   original process pumps bytes between that and the real terminal,
+   timestamping every chunk of output into the recording. Lines typed at
+   the prompt come over a pipe from the session's input loop (readline,
+   here-document "> " lines, a multiplexed session's lines).
+
+   The pump only copies chunks into a buffer; a writer thread compresses
+   filled buffers (or whatever came in during the last second) with
+   deflate and appends them to FILE, so a slow disk never holds up the
+   terminal. The file is append-only and self-delimiting, so several
+   sessions can share it and a crash loses at most the last second:
+
+       session:  "SRS1" u32 length, asciicast v2 header (JSON)
+       block:    "SRB1" u64 start (us) u32 raw length u32 packed length,
+                 deflated events
+       event:    varint us since the previous event (the first: since
+                 the block's start), type byte ('o' output, 'i' input
+                 line, 'r' resize "COLSxROWS"), varint length, data
+
+   Integers are little-endian; start is microseconds since the session
+   began. shell --cast FILE [N] writes session N (default: the last) as
+   asciicast v2 for asciinema play and the web players. */
+static int record_input_fd = -1;		// session side: typed lines go to the recorder here
+
+// Helper: Passes a line typed in this session to the recorder, if recording
+void record_input(const string& line){
+    if(record_input_fd < 0) return;
+    string message = line+"\n";
+    write_all(record_input_fd, message.data(), message.size());
+}
+
+const size_t RECORD_BLOCK_SIZE = 64 << 10;		// raw bytes per compressed block, at most
+const int RECORD_FLUSH_MS = 1000;				// a partly filled block is written after this long
+const size_t RECORD_MAX_PENDING = 32;			// blocks waiting for the writer before the pump waits too
+
+// Helper: Appends n as a little-endian integer of size bytes
+void put_le(string& out, uint64_t n, int size){
+    for(int i=0; i<size; i++) out += char((n >> (8*i)) & 0xff);
+}
+
+// Helper: Appends n in 7-bit groups, low first (the high bit marks more to come)
+void put_varint(string& out, uint64_t n){
+    while(n >= 0x80){
+        out += char((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    out += char(n);
+}
+
+class SessionRecorder {
+public:
+    SessionRecorder(int fd) : fd(fd), started(Clock::now()), writer([this](){ write_blocks(); }) {}
+
+    ~SessionRecorder(){
+        {
+            lock_guard<mutex> lock(m);
+            done = true;
+        }
+        cv.notify_one();
+        space.notify_all();
+        writer.join();
+        close(fd);
+    }
+
+    // The asciicast header of a new session in the file
+    void start_session(const string& header){
+        string record = "SRS1";
+        put_le(record, header.size(), 4);
+        record += header;
+        lock_guard<mutex> lock(m);
+        full.push_back(std::move(record));
+    }
+
+    /* Called by the pump: timestamps one event into the current block.
+       A disk slower than the output holds up the pump (and so the
+       session) instead of letting the backlog grow without bound. */
+    void event(char type, const char* data, size_t len){
+        uint64_t now = chrono::duration_cast<chrono::microseconds>(Clock::now()-started).count();
+        unique_lock<mutex> lock(m);
+        space.wait(lock, [this](){ return done || full.size() < RECORD_MAX_PENDING; });
+        if(block.empty()) block_start = last_event = now;
+        put_varint(block, now-last_event);
+        last_event = now;
+        block += type;
+        put_varint(block, len);
+        block.append(data, len);
+        if(block.size() >= RECORD_BLOCK_SIZE){
+            full.push_back(pack(block, block_start));
+            block.clear();
+            cv.notify_one();
+        }
+    }
+
+private:
+    // A block record still without its packed length; the writer deflates it
+    static string pack(const string& events, uint64_t start){
+        string record = "SRB1";
+        put_le(record, start, 8);
+        put_le(record, events.size(), 4);
+        record += events;		// packed length and deflate are filled in by the writer
+        return record;
+    }
+
+    // Helper: Deflates a block record's events in place
+    static void deflate_block(string& record){
+        if(record.compare(0, 4, "SRB1") != 0) return;		// session headers stay as they are
+        const size_t header = 4+8+4;
+        uLongf packed_len = compressBound(record.size()-header);
+        string packed(header+4+packed_len, '\0');
+        memcpy(packed.data(), record.data(), header);
+        compress2(reinterpret_cast<Bytef*>(packed.data()+header+4), &packed_len,
+                  reinterpret_cast<const Bytef*>(record.data()+header), record.size()-header, Z_BEST_SPEED);
+        for(int i=0; i<4; i++) packed[header+i] = char((packed_len >> (8*i)) & 0xff);
+        packed.resize(header+4+packed_len);
+        record.swap(packed);
+    }
+
+    // Writer thread: compresses and appends whatever is ready, at least once per flush interval
+    void write_blocks(){
+        unique_lock<mutex> lock(m);
+        while(true){
+            cv.wait_for(lock, chrono::milliseconds(RECORD_FLUSH_MS), [this](){ return done || !full.empty(); });
+            if(!block.empty() && (done || full.empty())){
+                full.push_back(pack(block, block_start));
+                block.clear();
+            }
+            deque<string> ready;
+            ready.swap(full);
+            bool finished = done;
+            lock.unlock();
+            space.notify_all();
+            for(auto& record : ready){
+                deflate_block(record);
+                if(!write_all(fd, record.data(), record.size()) && !write_failed){
+                    write_failed = true;
+                    perror("shell: recording");
+                }
+            }
+            lock.lock();
+            if(finished && full.empty() && block.empty()) return;
+        }
+    }
+
+    int fd;
+    Clock::time_point started;
+    mutex m;
+    condition_variable cv;
+    condition_variable space;	// the pump waits on it while full is at RECORD_MAX_PENDING
+    string block;				// events since the last block was handed over
+    uint64_t block_start = 0;
+    uint64_t last_event = 0;
+    deque<string> full;			// records waiting for the writer
+    bool done = false;
+    bool write_failed = false;	// writer thread only
+    thread writer;				// last: started once the rest is set up
+};
+
+static volatile sig_atomic_t pump_winch = 0;
+static volatile sig_atomic_t pump_stop = 0;
+static volatile sig_atomic_t pump_child = 1;		// check whether the session has exited
+
+void on_pump_signal(int sig){
+    if(sig == SIGWINCH) pump_winch = 1;
+    else if(sig == SIGCHLD) pump_child = 1;
+    else pump_stop = 1;
+}
+
+// Helper: The asciicast v2 header line of a session on this terminal
+string cast_header(const struct winsize& size){
+    string header = "{\"version\": 2, \"width\": "+to_string(size.ws_col ? size.ws_col : 80)+
+                    ", \"height\": "+to_string(size.ws_row ? size.ws_row : 24)+
+                    ", \"timestamp\": "+to_string(time(nullptr))+", \"env\": {\"SHELL\": \"";
+    json_escape(var_value("SHELL"), header);
+    header += "\", \"TERM\": \"";
+    json_escape(var_value("TERM"), header);
+    header += "\"}}";
+    return header;
+}
+
+/* Helper:
+		Recorder side: pumps the session's terminal (master) or its
+		output pipes (out, err) to the real ones, recording as it goes,
+		until the session has exited and its output is drained (jobs it
+		left running in the background don't keep the pump going).
+		Returns the session's exit status. */
+int run_pump(SessionRecorder& recorder, pid_t session, int master, int out, int err, int input){
+    struct sigaction handler = {};
+    handler.sa_handler = on_pump_signal;		// no SA_RESTART: poll returns to handle it
+    for(int sig : {SIGWINCH, SIGCHLD, SIGHUP, SIGTERM}) sigaction(sig, &handler, nullptr);
+    signal(SIGINT, SIG_IGN);		// the session gets these from its own terminal
+    signal(SIGQUIT, SIG_IGN);
+
+    vector<char> buf(1 << 16);
+    string typed;					// an input line still being received
+    // fds[i] is forwarded to to[i]; -1 once closed
+    int fds[4] = {master, out, err, input};
+    const int to[4] = {STDOUT_FILENO, STDOUT_FILENO, STDERR_FILENO, -1};
+    bool from_terminal = master >= 0;
+    bool session_done = false;
+    int wstatus = 0;
+
+    while(fds[0] >= 0 || fds[1] >= 0 || fds[2] >= 0){
+        if(pump_child && !session_done){
+            pump_child = 0;
+            session_done = waitpid(session, &wstatus, WNOHANG) == session;
+        }
+        if(pump_stop){
+            pump_stop = 0;
+            kill(master >= 0 ? -session : session, SIGHUP);
+        }
+        if(pump_winch && master >= 0){
+            pump_winch = 0;
+            struct winsize size;
+            if(ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0){
+                ioctl(master, TIOCSWINSZ, &size);
+                string dims = to_string(size.ws_col)+"x"+to_string(size.ws_row);
+                recorder.event('r', dims.data(), dims.size());
+            }
+        }
+
+        struct pollfd pfds[5];
+        int n = 0;
+        for(int fd : fds){
+            if(fd >= 0) pfds[n++] = {fd, POLLIN, 0};
+        }
+        if(from_terminal && !session_done) pfds[n++] = {STDIN_FILENO, POLLIN, 0};
+        // once the session is gone, only what it already wrote is collected
+        int ready = poll(pfds, n, session_done ? 0 : 1000);
+        if(ready < 0) continue;		// EINTR: a signal to handle
+        if(ready == 0){
+            if(session_done) break;
+            pump_child = 1;
+            continue;
+        }
+
+        for(int i=0; i<n; i++){
+            if(!pfds[i].revents) continue;
+            int fd = pfds[i].fd;
+            ssize_t r = read(fd, buf.data(), buf.size());
+            if(r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+            if(fd == STDIN_FILENO){
+                // keystrokes go to the session's terminal; a closed terminal hangs it up
+                if(r <= 0){
+                    from_terminal = false;
+                    kill(-session, SIGHUP);
+                }
+                else write_all(master, buf.data(), r);
+                continue;
+            }
+            int k = find(begin(fds), end(fds), fd)-begin(fds);
+            if(r <= 0){		// EOF, or EIO from a master nobody has open anymore
+                close(fd);
+                fds[k] = -1;
+                continue;
+            }
+            if(fd == input){
+                typed.append(buf.data(), r);
+                size_t nl;
+                while((nl = typed.find('\n')) != string::npos){
+                    recorder.event('i', typed.data(), nl);
+                    typed.erase(0, nl+1);
+                }
+                continue;
+            }
+            recorder.event('o', buf.data(), r);
+            if(!write_all(to[k], buf.data(), r)){
+                /* The reader is gone (EPIPE) or the terminal broke: stop
+                   forwarding this side so the session finds out too, as
+                   EPIPE/SIGPIPE on its pipe or a hangup on its terminal. */
+                if(fd == master) kill(-session, SIGHUP);
+                close(fd);
+                fds[k] = -1;
+            }
+        }
+    }
+    for(int fd : fds){
+        if(fd >= 0) close(fd);
+    }
+
+    if(!session_done){
+        while(waitpid(session, &wstatus, 0) < 0 && errno == EINTR){}
+    }
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+}
+
+/* Helper:
+		Starts recording into path: returns in the session (a child with
+		the new pty or pipes as its stdio), while the original process
+		stays behind as the pump and exits with the session's status.
+		Runs before anything else is set up, so the pump holds nothing
+		the session needs.
+		Without a usable file or pty the session simply isn't recorded. */
+void start_recording(const string& path){
+    // the session (and shells it starts) must not record themselves again
+    variables.erase("SHELL_RECORD");
+    int file = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(file < 0){
+        perror(path.c_str());
+        return;
+    }
+
+    bool terminal = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    struct termios saved_term;
+    struct winsize size = {};
+    int master = -1, slave = -1;
+    int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1}, input[2];
+    if(terminal){
+        tcgetattr(STDIN_FILENO, &saved_term);
+        ioctl(STDIN_FILENO, TIOCGWINSZ, &size);
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || !ptsname(master)){
+            perror("shell: recording: pty");
+            if(master >= 0) close(master);
+            close(file);
+            return;
+        }
+        fcntl(master, F_SETFD, FD_CLOEXEC);
+        // opened here, so the pty never looks hung up before the session has it
+        slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if(slave < 0){
+            perror("shell: recording: pty");
+            close(master);
+            close(file);
+            return;
+        }
+    }
+    else if(pipe(out_pipe) < 0 || pipe(err_pipe) < 0){
+        perror("pipe");
+        close(file);
+        return;
+    }
+    if(pipe(input) < 0){
+        perror("pipe");
+        close(file);
+        return;
+    }
+    fcntl(input[0], F_SETFD, FD_CLOEXEC);
+    fcntl(input[1], F_SETFD, FD_CLOEXEC);
+
+    flush_output();
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        close(file);
+        return;
+    }
+    if(pid == 0){
+        // ---------- the session ----------
+        close(file);
+        close(input[0]);
+        record_input_fd = input[1];
+        if(terminal){
+            close(master);
+            setsid();
+            ioctl(slave, TIOCSCTTY, 0);
+            tcsetattr(slave, TCSANOW, &saved_term);
+            ioctl(slave, TIOCSWINSZ, &size);
+            for(int i=0; i<3; i++) dup2(slave, i);		// dup2 clears close-on-exec
+            if(slave > 2) close(slave);
+        }
+        else{
+            dup2(out_pipe[1], STDOUT_FILENO);
+            dup2(err_pipe[1], STDERR_FILENO);
+            for(int fd : {out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]}) close(fd);
+        }
+        return;
+    }
+
+    // ---------- the pump ----------
+    close(input[1]);
+    if(terminal) close(slave);
+    else{
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+    }
+    int status;
+    {
+        SessionRecorder recorder(file);
+        recorder.start_session(cast_header(size));
+        if(terminal){
+            // raw: every key reaches the session's terminal, which does the line editing and signals
+            struct termios raw = saved_term;
+            cfmakeraw(&raw);
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        }
+        status = run_pump(recorder, pid, master, out_pipe[0], err_pipe[0], input[0]);
+        if(terminal) tcsetattr(STDIN_FILENO, TCSANOW, &saved_term);
+    }
+    _exit(status);		// the session owns everything else (trace file, history, metrics)
+}
+
+// Helper: Little-endian integer at p
+uint64_t get_le(const char* p, int size){
+    uint64_t n = 0;
+    for(int i=size-1; i>=0; i--) n = (n << 8) | static_cast<unsigned char>(p[i]);
+    return n;
+}
+
+// Helper: Reads a varint at text[pos]; false if it runs past the end
+bool get_varint(const string& text, size_t& pos, uint64_t& n){
+    n = 0;
+    for(int shift=0; pos<text.size() && shift<64; shift+=7){
+        unsigned char c = text[pos++];
+        n |= uint64_t(c & 0x7f) << shift;
+        if(!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+/* Helper:
+		Appends output bytes to a JSON string as valid UTF-8: a sequence
+		split across two chunks is held back in carry until the rest
+		arrives; stray bytes become U+FFFD. */
+void json_utf8(const string& data, string& carry, string& out){
+    string text = carry+data;
+    carry.clear();
+    string valid;
+    for(size_t i=0; i<text.size(); ){
+        unsigned char c = text[i];
+        size_t len = c < 0x80 ? 1 : (c >> 5) == 6 ? 2 : (c >> 4) == 14 ? 3 : (c >> 3) == 30 ? 4 : 0;
+        if(len == 0){
+            valid += "\xef\xbf\xbd";
+            i++;
+            continue;
+        }
+        if(i+len > text.size()){
+            carry = text.substr(i);
+            break;
+        }
+        bool ok = true;
+        for(size_t k=1; k<len; k++) ok = ok && (static_cast<unsigned char>(text[i+k]) >> 6) == 2;
+        if(!ok){
+            valid += "\xef\xbf\xbd";
+            i++;
+            continue;
+        }
+        valid.append(text, i, len);
+        i += len;
+    }
+    json_escape(valid, out);
+}
+
+/* Helper:
+		shell --cast FILE [N]: writes session N (1-based, default: the
+		last one) of a recording to stdout as asciicast v2. */
+int export_cast(const char* path, int wanted){
+    ifstream in(path, ios::binary);
+    if(!in){
+        cerr<<"shell: "<<path<<": "<<strerror(errno)<<"\n";
+        return 1;
+    }
+    string file((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    // first pass: where each session starts
+    vector<size_t> sessions;
+    size_t pos = 0;
+    while(pos+8 <= file.size()){
+        string tag = file.substr(pos, 4);
+        size_t len;
+        if(tag == "SRS1"){
+            sessions.push_back(pos);
+            len = 8+get_le(file.data()+pos+4, 4);
+        }
+        else if(tag == "SRB1" && pos+20 <= file.size()) len = 20+get_le(file.data()+pos+16, 4);
+        else break;
+        if(pos+len > file.size()) break;
+        pos += len;
+    }
+    if(pos != file.size()) cerr<<"shell: "<<path<<": truncated or damaged after byte "<<pos<<"\n";
+    if(sessions.empty() || wanted > static_cast<int>(sessions.size()) || wanted < 0){
+        cerr<<"shell: "<<path<<": no session "<<(wanted ? to_string(wanted) : string("recorded"))<<"\n";
+        return 1;
+    }
+    size_t start = sessions[wanted ? wanted-1 : sessions.size()-1];
+    size_t header_len = get_le(file.data()+start+4, 4);
+    string out = file.substr(start+8, header_len)+"\n";
+
+    string carry;
+    char num[32];
+    for(pos = start+8+header_len; pos+20 <= file.size() && file.compare(pos, 4, "SRB1") == 0; ){
+        uint64_t time = get_le(file.data()+pos+4, 8);
+        uLongf raw_len = get_le(file.data()+pos+12, 4);
+        size_t packed_len = get_le(file.data()+pos+16, 4);
+        if(pos+20+packed_len > file.size()) break;
+        string events(raw_len, '\0');
+        if(uncompress(reinterpret_cast<Bytef*>(events.data()), &raw_len,
+                      reinterpret_cast<const Bytef*>(file.data()+pos+20), packed_len) != Z_OK){
+            cerr<<"shell: "<<path<<": damaged block at byte "<<pos<<"\n";
+            break;
+        }
+        pos += 20+packed_len;
+
+        size_t i = 0;
+        uint64_t delta, len;
+        while(i < events.size() && get_varint(events, i, delta) && i < events.size()){
+            time += delta;
+            char type = events[i++];
+            if(!get_varint(events, i, len) || i+len > events.size()) break;
+            string data = events.substr(i, len);
+            i += len;
+            snprintf(num, sizeof num, "[%.6f, \"", time/1e6);
+            out += num;
+            out += type;
+            out += "\", \"";
+            if(type == 'o') json_utf8(data, carry, out);
+            else{
+                string none;
+                json_utf8(type == 'i' ? data+"\n" : data, none, out);
+            }
+            out += "\"]\n";
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Main Shell Loop (REPL)
+// ------------------------------------------------------------
+// Helper: Interactive setup that doesn't need the terminal (done ahead of time by pool workers)
+void prepare_interactive(){
+	TRACE_SPAN("prepare_interactive");
+	// ------------------------------------------------------------
+	// Load history from HISTFILE on startup; lines are appended as accepted
+	// ------------------------------------------------------------
+	if(const string* histfile = get_var("HISTFILE")){
+		open_history_file(*histfile);
+		last_history_written = history_length;
+	}
+
+  	// Bind tab key for auto completion; the executable index builds in the background
+  	start_exec_index();
+  	rl_bind_key('\t', handle_tab);
+  	rl_bind_key(CTRL('R'), handle_reverse_search);
+}
+
+void run_interactive(){
+	cout<<"[MY CUSTOM SHELL IS RUNNING]\n";
+
+	// here-document bodies are typed at a "> " prompt
+	next_input_line = [](string& line){
+		char* raw = readline("> ");
+		if(!raw) return false;
+		line = raw;
+		free(raw);
+		record_input(line);
+		return true;
+	};
+
+	// process the input
+	while(!exit_requested){
+		reap_jobs(true);
+		char* raw = readline("$ ");
+    	if(!raw) break;  
+    	string input(raw);
+    	free(raw);
+    	record_input(input);
+    	if(input.empty()) continue;
+    	record_history(input);
+    	run_line(input);
+	}
+
+	// HISTFILE is already up to date; only a running compaction needs finishing
+	wait_history_compactor();
+	wait_exec_index();
+}
+
+// ------------------------------------------------------------
+// Pre-forked session pool (shell --pool SOCKET, shell --attach SOCKET)
+// ------------------------------------------------------------
+/* The pool master keeps N idle workers, each of which has already
+   loaded HISTFILE and built the completion index and now waits in
+   accept() on a Unix socket. `shell --attach SOCKET` (what the web
+   server starts on each new pty) connects, gives up its controlling
+   terminal and passes its stdin/stdout/stderr with SCM_RIGHTS along
+   with its cwd and environment. The worker adopts the terminal and
+   runs the session; the master forks a replacement. When the session
+   ends the worker sends its exit status back and the client exits
+   with it, so to the server it looks like the shell ran in-place. */
+const uint32_t attach_max_payload = 1 << 20;
+static volatile sig_atomic_t pool_stop = 0;
+
+void on_pool_stop(int){
+    pool_stop = 1;
+}
+
+// Helper: Loops over short reads/writes on a stream socket
+bool read_all(int fd, void* data, size_t len){
+    char* p = static_cast<char*>(data);
+    while(len > 0){
+        ssize_t r = read(fd, p, len);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* data, size_t len){
+    const char* p = static_cast<const char*>(data);
+    while(len > 0){
+        ssize_t w = write(fd, p, len);
+        if(w < 0 && errno == EINTR) continue;
+        if(w < 0) return false;
+        p += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Helper: Fills a sockaddr_un; false if the path doesn't fit
+bool unix_address(const char* path, struct sockaddr_un& addr){
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof addr.sun_path) return false;
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+/* Helper:
+		Attach request: a length-prefixed payload (cwd, then NAME=VALUE
+		environment entries, NUL-separated) whose first sendmsg() also
+		carries the three stdio fds as SCM_RIGHTS, plus a fourth when
+		the session is recorded (where its typed lines go; -1: none). */
+bool send_attach(int sock, const string& payload, const int fds[4]){
+    int count = fds[3] >= 0 ? 4 : 3;
+    uint32_t len = payload.size();
+    struct iovec iov = {&len, sizeof len};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(4*sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count*sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count*sizeof(int));
+    ssize_t sent;
+    while((sent = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR){}
+    return sent == static_cast<ssize_t>(sizeof len) && write_all(sock, payload.data(), payload.size());
+}
+
+/* Helper:
+		Receives the length and fds of an attach request. 1 on success,
+		0 if nothing has arrived yet on a non-blocking socket, -1 if the
+		request is malformed or the client went away. */
+int recv_attach_header(int sock, uint32_t& len, int fds[4]){
+    struct iovec iov = {&len, sizeof len};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(4*sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    ssize_t got;
+    while((got = recvmsg(sock, &msg, MSG_WAITALL)) < 0 && errno == EINTR){}
+    if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    // the length and fds come from one sendmsg(), so they arrive together
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(got != static_cast<ssize_t>(sizeof len) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+       (cmsg->cmsg_len != CMSG_LEN(3*sizeof(int)) && cmsg->cmsg_len != CMSG_LEN(4*sizeof(int))) || len > attach_max_payload){
+        return -1;
+    }
+    int count = cmsg->cmsg_len == CMSG_LEN(4*sizeof(int)) ? 4 : 3;
+    fds[3] = -1;
+    memcpy(fds, CMSG_DATA(cmsg), count*sizeof(int));
+    return 1;
+}
+
+bool recv_attach(int sock, string& payload, int fds[4]){
+    uint32_t len = 0;
+    if(recv_attach_header(sock, len, fds) != 1) return false;
+    payload.resize(len);
+    return read_all(sock, payload.data(), len);
+}
+
+// Helper: cwd followed by every exported NAME=VALUE entry, NUL-separated
+string session_payload(){
+    string payload = filesystem::current_path().string();
+    for(char** e = shell_envp(); *e; e++){
+        payload += '\0';
+        payload += *e;
+    }
+    return payload;
+}
+
+vector<string> split_payload(const string& payload){
+    vector<string> fields;
+    for(size_t start = 0; start < payload.size(); ){
+        size_t end = payload.find('\0', start);
+        if(end == string::npos) end = payload.size();
+        fields.push_back(payload.substr(start, end-start));
+        start = end+1;
+    }
+    return fields;
+}
+
+// Helper: Replaces the environment (and with it the exported variables) with NAME=VALUE entries
+void replace_environment(const vector<string>& entries){
+    extern char** environ;
+    vector<string> names;
+    for(char** e = environ; e && *e; e++){
+        const char* eq = strchr(*e, '=');
+        names.push_back(eq ? string(*e, eq-*e) : string(*e));
+    }
+    for(const auto& name : names) unsetenv(name.c_str());
+    for(const auto& entry : entries){
+        size_t eq = entry.find('=');
+        if(eq != string::npos && eq > 0) setenv(entry.substr(0, eq).c_str(), entry.c_str()+eq+1, 1);
+    }
+    variables.clear();
+    import_environment();
+}
+
+// Helper: Listening socket at path, readable only by this user; -1 after reporting an error
+int listen_unix(const char* socket_path){
+    struct sockaddr_un addr;
+    if(!unix_address(socket_path, addr)){
+        cerr<<"shell: "<<socket_path<<": socket path too long\n";
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        perror("socket");
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    unlink(socket_path);
+    mode_t old_mask = umask(077);		// only this user may attach
+    int bound = bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+    umask(old_mask);
+    if(bound < 0 || listen(listen_fd, 128) < 0){
+        perror(socket_path);
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+/* Helper:
+		A pool worker: warm up, wait for one client, then become that
+		client's interactive shell. Never returns. */
+[[noreturn]] void run_pool_worker(int listen_fd, int taken_fd, pid_t master){
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);		// idle workers go away with the master
+    if(getppid() != master) _exit(0);
+#endif
+    prepare_interactive();
+    wait_exec_index();		// completion index ready before the first TAB
+
+    int conn;
+    while((conn = accept(listen_fd, nullptr, nullptr)) < 0){
+        if(errno != EINTR && errno != ECONNABORTED) _exit(1);
+        if(pool_stop) _exit(0);
+    }
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, 0);
+#endif
+    close(listen_fd);
+    pid_t self = getpid();
+    write_all(taken_fd, &self, sizeof self);
+    close(taken_fd);
+    signal(SIGTERM, SIG_DFL);
+
+    string payload;
+    int fds[4];
+    if(!recv_attach(conn, payload, fds)) _exit(1);
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+    if(fds[3] >= 0){
+        record_input_fd = fds[3];
+        fcntl(record_input_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // A new session whose controlling terminal is the client's pty
+    setsid();
+    for(int i=0; i<3; i++){
+        dup2(fds[i], i);
+    }
+    for(int i=0; i<3; i++){
+        if(fds[i] > 2) close(fds[i]);
+    }
+    if(isatty(STDIN_FILENO)) ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+#ifdef __linux__
+    start_session_cgroup();		// as configured for the pool, before the client's environment
+#endif
+
+    vector<string> fields = split_payload(payload);
+    if(!fields.empty()){
+        if(chdir(fields[0].c_str()) != 0) perror(fields[0].c_str());
+        replace_environment(vector<string>(fields.begin()+1, fields.end()));
+    }
+
+    interactive = true;
+    cout << std::unitbuf;
+    cerr << std::unitbuf;
+    init_job_control();
+    run_interactive();
+
+    int status = last_status;
+    write_all(conn, &status, sizeof status);
+    exit(status);
+}
+
+/* Helper:
+		shell --pool SOCKET [-n N]: listen on SOCKET and keep N warm
+		sessions waiting. Runs until SIGTERM/SIGINT; sessions already
+		handed out keep running. */
+int run_pool(const char* socket_path, int size){
+    int listen_fd = listen_unix(socket_path);
+    if(listen_fd < 0) return 1;
+
+    int taken[2];
+    if(pipe(taken) < 0){
+        perror("pipe");
+        return 1;
+    }
+    fcntl(taken[0], F_SETFD, FD_CLOEXEC);
+    fcntl(taken[1], F_SETFD, FD_CLOEXEC);
+
+    struct sigaction stop = {};
+    stop.sa_handler = on_pool_stop;
+    sigaction(SIGTERM, &stop, nullptr);
+    sigaction(SIGINT, &stop, nullptr);
+
+    pid_t master = getpid();
+    unordered_set<pid_t> idle;
+    auto spawn_worker = [&](){
+        flush_output();
+        pid_t pid = fork();
+        if(pid == 0){
+            close(taken[0]);
+            run_pool_worker(listen_fd, taken[1], master);
+        }
+        if(pid < 0) perror("fork");
+        else idle.insert(pid);
+    };
+    for(int i=0; i<size; i++) spawn_worker();
+    cerr<<"shell: pool of "<<size<<" sessions on "<<socket_path<<"\n";
+
+    while(!pool_stop){
+        struct pollfd pfd = {taken[0], POLLIN, 0};
+        if(poll(&pfd, 1, 1000) > 0){
+            pid_t pid;
+            if(read_all(taken[0], &pid, sizeof pid) && idle.erase(pid)) spawn_worker();
+        }
+        // replace idle workers that died (a worker that crashes on start-up is retried slowly)
+        int died = 0;
+        pid_t pid;
+        int wstatus;
+        while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0){
+            if(idle.erase(pid)) died++;
+        }
+        if(died > 0 && !pool_stop){
+            usleep(100000);
+            for(int i=0; i<died; i++) spawn_worker();
+        }
+    }
+
+    for(pid_t pid : idle) kill(pid, SIGTERM);
+    unlink(socket_path);
+    return 0;
+}
+
+/* Helper:
+		shell --attach SOCKET: hands this process's terminal to a warm
+		pool worker and returns the session's exit status, or -1 if no
+		pool answered (the caller then runs the session itself). */
+int run_attach(const char* socket_path){
+    struct sockaddr_un addr;
+    if(!unix_address(socket_path, addr)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) return -1;
+    if(connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0){
+        close(sock);
+        return -1;
+    }
+
+    string payload = session_payload();
+
+    /* The worker can only make the pty its controlling terminal once
+       this session lets go of it. Doing so as session leader sends
+       SIGHUP to our own process group, so it is ignored meanwhile. */
+    bool had_tty = isatty(STDIN_FILENO);
+    signal(SIGHUP, SIG_IGN);
+    if(had_tty) ioctl(STDIN_FILENO, TIOCNOTTY);
+    signal(SIGHUP, SIG_DFL);
+
+    int fds[4] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, record_input_fd};
+    if(!send_attach(sock, payload, fds)){
+        close(sock);
+        if(had_tty) ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+        return -1;
+    }
+    int status;
+    if(!read_all(sock, &status, sizeof status)) status = 128+SIGHUP;	// worker hung up with the terminal
+    close(sock);
+    return status;
+}
+
+#ifdef __linux__
+// ------------------------------------------------------------
+// Multiplexed sessions (shell --multiplex SOCKET)
+// ------------------------------------------------------------
+/* One process serves many terminals. Clients attach exactly as they do
+   to a pool (shell --attach SOCKET), but the terminal is not adopted:
+   the multiplexer keeps each session's cwd, environment and history in
+   a small struct and watches every terminal with epoll. Line editing is
+   left to the terminal's canonical mode (erase, kill, word erase, ^D),
+   so no readline state exists per session; TAB completion and Ctrl-R
+   are not available. Each accepted line runs in a forked child that
+   becomes the terminal's session leader, applies the session's state,
+   runs the line with job control, and reports its status, cwd and
+   environment back over a pipe. */
+struct MuxSession {
+    int fds[3] = {-1, -1, -1};	// the client's stdin/stdout/stderr (its pty)
+    int record = -1;			// typed lines go to the client's recorder (-1: not recorded)
+    int cgroup = -1;			// the session's cgroup (SHELL_CGROUP): directory fd, -1 without
+    string cgroup_path;
+    int conn = -1;				// attach connection; the exit status goes back here
+    bool attached = false;		// the attach request has been read in full
+    long attach_len = -1;		// its payload length, -1 until the header arrived
+    string attach_payload;
+    string cwd;
+    vector<string> env;
+    vector<string> history;		// lines entered in this session
+    string pending;				// typed-ahead input not run yet
+    struct termios term;		// restored after every command line
+    bool has_term = false;
+    pid_t child = -1;			// command line in progress
+    int report = -1;			// its report pipe
+    string report_buf;
+    int status = 0;
+};
+
+enum MuxFd : uint64_t { MUX_LISTEN, MUX_TTY, MUX_CONN, MUX_REPORT };
+
+static map<int, MuxSession> mux_sessions;		// by session id
+static int mux_epoll = -1;
+static int mux_listen = -1;
+
+// Helper: Registers/updates/removes an fd; the tag packs the session id and which fd it is
+void mux_watch(int op, int fd, uint32_t events, int id, MuxFd kind){
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = (uint64_t(id) << 2) | kind;
+    epoll_ctl(mux_epoll, op, fd, &ev);
+}
+
+void mux_prompt(MuxSession& session){
+    write_all(session.fds[1], "$ ", 2);
+}
+
+// Helper: Closes a session and tells its attach client how it ended
+void mux_end(int id, int status){
+    MuxSession& session = mux_sessions[id];
+    if(session.child > 0) kill(-session.child, SIGHUP);
+    // the client still holds the pty, so its registration must be dropped explicitly
+    epoll_ctl(mux_epoll, EPOLL_CTL_DEL, session.fds[0], nullptr);
+    epoll_ctl(mux_epoll, EPOLL_CTL_DEL, session.conn, nullptr);
+    if(session.report >= 0){
+        epoll_ctl(mux_epoll, EPOLL_CTL_DEL, session.report, nullptr);
+        close(session.report);
+    }
+    write_all(session.conn, &status, sizeof status);
+    close(session.conn);
+    for(int fd : session.fds) close(fd);
+    if(session.record >= 0) close(session.record);
+    if(session.cgroup >= 0){
+        close(session.cgroup);
+        remove_cgroup_tree(AT_FDCWD, session.cgroup_path.c_str());
+    }
+    mux_sessions.erase(id);
+}
+
+/* Helper:
+		Child side of one command line: leave nothing of the multiplexer
+		or the other sessions behind, take the session's terminal, state
+		and history, run the line, report back. Never returns. */
+[[noreturn]] void mux_run_child(int id, const string& line, int report_fd){
+    MuxSession& session = mux_sessions[id];
+    for(auto& [other_id, other] : mux_sessions){
+        if(other_id == id) continue;
+        for(int fd : other.fds) close(fd);
+        close(other.conn);
+        if(other.report >= 0) close(other.report);
+        if(other.record >= 0) close(other.record);
+        if(other.cgroup >= 0) close(other.cgroup);
+    }
+    close(session.conn);
+    close(mux_epoll);
+    close(mux_listen);
+    signal(SIGTERM, SIG_DFL);
+
+    if(session.cgroup >= 0) join_session_cgroup(session.cgroup);
+    setsid();
+    for(int i=0; i<3; i++){
+        dup2(session.fds[i], i);
+    }
+    for(int fd : session.fds){
+        if(fd > 2) close(fd);
+    }
+    if(isatty(STDIN_FILENO)) ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+    if(chdir(session.cwd.c_str()) != 0) perror(session.cwd.c_str());
+    replace_environment(session.env);
+    for(const auto& entry : session.history) history_add(entry);
+    last_status = session.status;		// $? of the session's previous line
+
+    interactive = true;
+    cout << std::unitbuf;
+    cerr << std::unitbuf;
+    init_job_control();
+    run_line(line);
+    flush_output();
+
+    string payload = session_payload();
+    uint32_t header[3] = {uint32_t(last_status), exit_requested ? 1u : 0u, uint32_t(payload.size())};
+    write_all(report_fd, header, sizeof header);
+    write_all(report_fd, payload.data(), payload.size());
+    _exit(0);
+}
+
+// Helper: Runs queued lines until one starts a command (or input runs out)
+void mux_next_line(int id){
+    MuxSession& session = mux_sessions[id];
+    size_t nl;
+    while(session.child < 0 && (nl = session.pending.find('\n')) != string::npos){
+        string line = session.pending.substr(0, nl);
+        session.pending.erase(0, nl+1);
+        if(session.record >= 0){
+            string message = line+"\n";
+            write_all(session.record, message.data(), message.size());
+        }
+        if(line.find_first_not_of(" \t") == string::npos){
+            mux_prompt(session);
+            continue;
+        }
+        session.history.push_back(line);
+        append_history_file(line);
+
+        int report[2];
+        if(pipe2(report, O_CLOEXEC) < 0){
+            perror("pipe");
+            mux_prompt(session);
+            continue;
+        }
+        flush_output();
+        pid_t pid = fork();
+        if(pid == 0){
+            close(report[0]);
+            mux_run_child(id, line, report[1]);
+        }
+        close(report[1]);
+        if(pid < 0){
+            perror("fork");
+            close(report[0]);
+            mux_prompt(session);
+            continue;
+        }
+        // the terminal belongs to the command line until it reports back
+        session.child = pid;
+        session.report = report[0];
+        session.report_buf.clear();
+        mux_watch(EPOLL_CTL_MOD, session.fds[0], 0, id, MUX_TTY);
+        mux_watch(EPOLL_CTL_ADD, session.report, EPOLLIN, id, MUX_REPORT);
+    }
+}
+
+// Helper: Input on a session's terminal; canonical mode delivers whole lines
+void mux_read_tty(int id){
+    MuxSession& session = mux_sessions[id];
+    char buf[4096];
+    ssize_t r = read(session.fds[0], buf, sizeof buf);
+    if(r < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if(r <= 0){
+        mux_end(id, session.status);		// ^D on an empty line, or the pty hung up
+        return;
+    }
+    session.pending.append(buf, r);
+    mux_next_line(id);
+}
+
+// Helper: Collects a command line's report; applies it once complete
+void mux_read_report(int id){
+    MuxSession& session = mux_sessions[id];
+    char buf[65536];
+    ssize_t r = read(session.report, buf, sizeof buf);
+    if(r < 0 && errno == EINTR) return;
+    if(r > 0) session.report_buf.append(buf, r);
+
+    uint32_t header[3];
+    bool complete = session.report_buf.size() >= sizeof header;
+    if(complete){
+        memcpy(header, session.report_buf.data(), sizeof header);
+        complete = session.report_buf.size() >= sizeof header + header[2];
+    }
+    if(!complete && r > 0) return;
+
+    bool exit_session = false;
+    if(complete){
+        session.status = header[0];
+        exit_session = header[1] != 0;
+        vector<string> fields = split_payload(session.report_buf.substr(sizeof header, header[2]));
+        if(!fields.empty()){
+            session.cwd = fields[0];
+            session.env.assign(fields.begin()+1, fields.end());
+        }
+    }
+    else session.status = 1;		// died without reporting
+
+    epoll_ctl(mux_epoll, EPOLL_CTL_DEL, session.report, nullptr);
+    close(session.report);
+    session.report = -1;
+    session.child = -1;
+    if(exit_session){
+        mux_end(id, session.status);
+        return;
+    }
+    if(session.has_term) tcsetattr(session.fds[0], TCSANOW, &session.term);
+    mux_watch(EPOLL_CTL_MOD, session.fds[0], EPOLLIN, id, MUX_TTY);
+    mux_prompt(session);
+    mux_next_line(id);
+}
+
+/* Helper:
+		A new client. Its attach request is read as it arrives, from the
+		event loop, so a client that stalls halfway holds up no one. */
+void mux_accept(int id){
+    int conn = accept4(mux_listen, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(conn < 0) return;
+    mux_sessions[id].conn = conn;
+    mux_watch(EPOLL_CTL_ADD, conn, EPOLLIN | EPOLLRDHUP, id, MUX_CONN);
+}
+
+// Helper: Drops a client whose attach request was cut short or malformed
+void mux_reject(int id){
+    MuxSession& session = mux_sessions[id];
+    epoll_ctl(mux_epoll, EPOLL_CTL_DEL, session.conn, nullptr);
+    close(session.conn);
+    for(int fd : session.fds) if(fd >= 0) close(fd);
+    if(session.record >= 0) close(session.record);
+    mux_sessions.erase(id);
+}
+
+// Helper: The attach request is complete: take the client's terminal, cwd and environment
+void mux_attached(int id){
+    MuxSession& session = mux_sessions[id];
+    session.attached = true;
+    int* fds = session.fds;
+    for(int i=0; i<3; i++){
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    if(session.record >= 0) fcntl(session.record, F_SETFD, FD_CLOEXEC);
+    vector<string> fields = split_payload(session.attach_payload);
+    session.attach_payload = string();
+    session.cwd = fields.empty() ? "/" : fields[0];
+    if(!fields.empty()) session.env.assign(fields.begin()+1, fields.end());
+
+    // One cgroup per session, as configured for the multiplexer; each command line's shell joins it
+    const string* cgroup = get_var("SHELL_CGROUP");
+    if(cgroup && !cgroup->empty()){
+        string name = "session-"+to_string(getpid())+"-"+to_string(id);
+        session.cgroup = open_session_cgroup(*cgroup, name);
+        session.cgroup_path = *cgroup+"/"+name;
+    }
+
+    // Canonical mode is the line editor
+    if(tcgetattr(fds[0], &session.term) == 0){
+        session.term.c_lflag |= ICANON | ECHO | ECHOE | ECHOK | ISIG | IEXTEN;
+        session.term.c_iflag |= ICRNL;
+        session.term.c_oflag |= OPOST | ONLCR;
+        tcsetattr(fds[0], TCSANOW, &session.term);
+        session.has_term = true;
+    }
+
+    mux_watch(EPOLL_CTL_ADD, fds[0], EPOLLIN, id, MUX_TTY);
+    const char banner[] = "[MY CUSTOM SHELL IS RUNNING]\n";
+    write_all(fds[1], banner, sizeof banner - 1);
+    mux_prompt(session);
+}
+
+// Helper: More of a client's attach request arrived (or the client hung up)
+void mux_read_attach(int id){
+    MuxSession& session = mux_sessions[id];
+    if(session.attach_len < 0){
+        uint32_t len;
+        int fds[4];
+        int got = recv_attach_header(session.conn, len, fds);
+        if(got == 0) return;
+        if(got < 0){
+            mux_reject(id);
+            return;
+        }
+        copy(fds, fds+3, session.fds);
+        session.record = fds[3];
+        session.attach_len = len;
+    }
+    while(session.attach_payload.size() < size_t(session.attach_len)){
+        char buf[4096];
+        ssize_t r = read(session.conn, buf, min(sizeof buf, session.attach_len-session.attach_payload.size()));
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if(r <= 0){
+            mux_reject(id);
+            return;
+        }
+        session.attach_payload.append(buf, r);
+    }
+    mux_attached(id);
+}
+
+/* Helper:
+		shell --multiplex SOCKET: serve every attached session from this
+		process until SIGTERM/SIGINT. */
+int run_multiplexer(const char* socket_path){
+    mux_listen = listen_unix(socket_path);
+    if(mux_listen < 0) return 1;
+    mux_epoll = epoll_create1(EPOLL_CLOEXEC);
+    mux_watch(EPOLL_CTL_ADD, mux_listen, EPOLLIN, 0, MUX_LISTEN);
+
+    struct sigaction stop = {};
+    stop.sa_handler = on_pool_stop;
+    sigaction(SIGTERM, &stop, nullptr);
+    sigaction(SIGINT, &stop, nullptr);
+
+    // sessions share the loaded history as a base and append to one HISTFILE
+    if(const string* histfile = get_var("HISTFILE")) open_history_file(*histfile);
+    cerr<<"shell: multiplexing sessions on "<<socket_path<<"\n";
+
+    int next_id = 1;
+    while(!pool_stop){
+        struct epoll_event events[64];
+        int n = epoll_wait(mux_epoll, events, 64, -1);
+        for(int i=0; i<n; i++){
+            int id = events[i].data.u64 >> 2;
+            MuxFd kind = MuxFd(events[i].data.u64 & 3);
+            if(kind == MUX_LISTEN){
+                mux_accept(next_id++);
+                continue;
+            }
+            if(!mux_sessions.count(id)) continue;		// ended earlier in this batch
+            if(kind == MUX_TTY) mux_read_tty(id);
+            else if(kind == MUX_REPORT) mux_read_report(id);
+            else if(!mux_sessions[id].attached) mux_read_attach(id);
+            else mux_end(id, 128+SIGHUP);					// attach client went away
+        }
+        // command line children; their own children were reparented when they exited
+        while(waitpid(-1, nullptr, WNOHANG) > 0){}
+    }
+
+    while(!mux_sessions.empty()) mux_end(mux_sessions.begin()->first, 128+SIGHUP);
+    wait_history_compactor();
+    unlink(socket_path);
+    return 0;
+}
+#endif
+
+/* Usage:
+		shell                 interactive (readline) when stdin is a terminal,
+		                      otherwise commands are read from stdin
+		shell -c 'commands'   run the given command string
+		shell script          run the commands in a file
+		shell --pool SOCKET [-n N]
+		                      keep N warm interactive sessions for --attach
+		shell --multiplex SOCKET
+		                      serve every --attach session from one process (Linux)
+		shell --attach SOCKET run this terminal's session in a pool worker
+		                      or multiplexer
+		shell --cast FILE [N] write session N of a SHELL_RECORD recording as
+		                      asciicast v2 */
+int main(int argc, char* argv[]){
+	// Builtins write into pipes from inside the shell; a closed reader must
+	// surface as EPIPE, not kill the shell
+	signal(SIGPIPE, SIG_IGN);
+
+	register_builtins();
+	shell_name = argv[0];
+
+	// The inherited environment becomes the exported shell variables
+	import_environment();
+
+	if(argc > 2 && string(argv[1]) == "--cast"){
+		int session = 0;
+		if(argc > 3){
+			char* end;
+			long n = strtol(argv[3], &end, 10);
+			if(*end || end == argv[3] || n < 1 || n > INT_MAX){
+				cerr<<argv[0]<<": --cast: "<<argv[3]<<": session number expected (1 is the first)\n";
+				return 2;
+			}
+			session = n;
 		}
+		return export_cast(argv[2], session);
+	}
 
-    	// cd: change directory
-    	else if(tokens[0]=="cd"){
-    	  	if(tokens.size()<2){
-    	    	cout << "cd: missing argument\n";
-    	  	}
-    	  	else{
-    	    	string path = tokens[1];
-    	    	if(path[0]=='~'){
-    	      		char* home = getenv("HOME");
-    	      		if(!home){
-    	        		cout << "cd: HOME not set\n";
-    	        		cout << "$ ";
-    	        		continue;
-    	      		}
-    	      		path = home;
-    	    	}
-    	    	if(chdir(path.c_str()) != 0){
-    	        	cout << "cd: " <<path<< ": No such file or directory\n";
-    	    	}
-    	  	}
-    	}
+	// Opt-in session recording: from here on this is the recorded session (pool and multiplexer
+	// servers aren't sessions; their --attach clients record)
+	const string* record_file = get_var("SHELL_RECORD");
+	bool server = argc > 1 && (string(argv[1]) == "--pool" || string(argv[1]) == "--multiplex");
+	if(record_file && !record_file->empty() && !server){
+		start_recording(string(*record_file));
+	}
 
-    	// type: identify command
-    	else if(tokens[0]=="type"){
-    	  	if(is_builtin(tokens[1])) cout<<tokens[1]<<" is a shell builtin\n";
-    	  	else{
-    	    	char* path = getenv("PATH");
-    	    	if(!path){
-    	      		cout<<tokens[1]<<": not found\n";
-    	    	}
-    	    	else{
-    	      		vector<string> dirs = split_path(path);
-    	      		bool not_found = true;
-    	      		for(auto &dir : dirs){
-    	        		string full_path = dir+'/'+input.substr(5);
-    	        		if(access(full_path.c_str(), F_OK)==0){
-    	          			if(access(full_path.c_str(), X_OK)==0){
-    	            			cout<<input.substr(5)<<" is "<<full_path<<endl;
-    	            			not_found = false;
-    	            			break;
-    	          			}
-    	        		}
-    	      		}
-    	      		if(not_found) cout<<input.substr(5)<<": not found\n";
-    	    	}
-    	  	}
-    	}
+	// Opt-in per-command metrics: one JSON line per command appended to this file
+	const string* metrics_log = get_var("SHELL_METRICS_LOG");
+	if(metrics_log && !metrics_log->empty()){
+		metrics_fd = open(metrics_log->c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(metrics_fd < 0) perror(metrics_log->c_str());
+	}
+
+#ifdef __linux__
+	// Opt-in cgroup v2 limits and accounting: a cgroup for this session under SHELL_CGROUP, one per
+	// job inside it (pool and multiplexer sessions get theirs when a client attaches)
+	bool attach = argc > 2 && string(argv[1]) == "--attach";
+	if(!server && !attach) start_session_cgroup();
+#endif
 
-    	// ------------------------------------------------------------
-    	// External Command Execution
-    	// ------------------------------------------------------------
-    	else{
-    	  	vector<char*> args = make_argv(tokens);
-    	  	pid_t pid = fork();
-    	  	if(pid==0){
-    	    	if(redirect_out){
-    	      		int fd = open(out_file.c_str(), O_WRONLY | O_CREAT | (append_out ? O_APPEND : O_TRUNC), 0644);
-    	      		if(fd<0){ 
-    	        		perror("open"); 
-    	        		exit(1);
-    	      		}
-    	      		dup2(fd, STDOUT_FILENO);
-    	      		close(fd);
-    	    	}
-    	    	if(redirect_err){
-    	      		int fd = open(err_file.c_str(), O_WRONLY | O_CREAT | (append_err ? O_APPEND : O_TRUNC), 0644);
-    	      		if(fd<0){ 
-    	        		perror("open");
-    	        		exit(1); 
-    	      		}
-    	      		dup2(fd, STDERR_FILENO);
-    	      		close(fd);
-    	    	}
-
-    	    	execvp(args[0], args.data());
-    	    	cout << args[0] << ": command not found\n";
-    	    	exit(1);
-    	  	}
-    	  	else if(pid>0){
-    	    	waitpid(pid, nullptr, 0);
-    	  	}
-    	  	else{
-    	    	cout<<input<<": command not found\n";
-    	  	}
+	// Finished background jobs are collected between commands
+	struct sigaction chld = {};
+	chld.sa_handler = on_sigchld;
+	chld.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &chld, nullptr);
+
+#ifdef SHELL_TRACE
+	// SHELL_TRACE=FILE: trace from the start and write FILE at exit
+	if(const string* trace_env = get_var("SHELL_TRACE")){
+		if(!trace_env->empty()){
+			trace_enabled.store(true, memory_order_relaxed);
+			trace_file = *trace_env;
+			trace_owner = getpid();
+			atexit(write_trace_file);
 		}
-		// ------------------------------------------------------------
-    	// Restore Original stdout and stderr
-		// ------------------------------------------------------------
-		if(redirect_out){
-			dup2(saved_stdout, STDOUT_FILENO);
-    	  	close(saved_stdout);
-    	}
-    	if(redirect_err){
-    	  	dup2(saved_stderr, STDERR_FILENO);
-    		close(saved_stderr);
+	}
+#endif
+
+	// Spawn backend: posix_spawn unless SHELL_SPAWN=fork
+	if(var_value("SHELL_SPAWN")=="fork"){
+		use_posix_spawn = false;
+	}
+
+	const char* command = nullptr;
+	const char* script = nullptr;
+	if(argc > 2 && string(argv[1]) == "--pool"){
+		int size = 4;
+		if(argc > 4 && string(argv[3]) == "-n") size = max(1, atoi(argv[4]));
+		return run_pool(argv[2], size);
+	}
+	if(argc > 2 && string(argv[1]) == "--multiplex"){
+#ifdef __linux__
+		return run_multiplexer(argv[2]);
+#else
+		cerr<<argv[0]<<": --multiplex needs epoll (Linux)\n";
+		return 2;
+#endif
+	}
+	if(argc > 2 && string(argv[1]) == "--attach"){
+		int status = run_attach(argv[2]);
+		if(status >= 0) return status;
+		argc = 1;		// no pool: run the session here
+#ifdef __linux__
+		start_session_cgroup();
+#endif
+	}
+	if(argc > 1){
+		if(string(argv[1]) == "-c"){
+			if(argc < 3){
+				cerr<<argv[0]<<": -c: option requires an argument\n";
+				return 2;
+			}
+			command = argv[2];
 		}
+		else script = argv[1];
+	}
+	interactive = !command && !script && isatty(STDIN_FILENO);
+
+	if(interactive){
+  		// Flush after every std::cout / std:cerr
+		cout << std::unitbuf;
+  		cerr << std::unitbuf;
+		init_job_control();
+		prepare_interactive();
+		run_interactive();
+		return last_status;
+	}
+
+	// Batch modes: fully buffered stdout, flushed before spawns and at exit
+	setvbuf(stdout, nullptr, _IOFBF, 1 << 16);
+	if(command){
+		run_string(command);
+	}
+	else if(script){
+		int fd = open(script, O_RDONLY | O_CLOEXEC);
+		if(fd < 0){
+			cerr<<argv[0]<<": "<<script<<": "<<strerror(errno)<<"\n";
+			return 127;
+		}
+		run_stream(fd, false);
+		close(fd);
+	}
+	else{
+		run_stream(STDIN_FILENO, true);
 	}
-	return 0;
+	flush_output();
+	return last_status;
 }
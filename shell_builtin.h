@@ -0,0 +1,51 @@
+/* ------------------------------------------------------------
+   Loadable builtins: the C ABI behind `enable -f LIB.so NAME`
+   ------------------------------------------------------------
+   A shared object provides a builtin NAME by exporting
+
+       struct shell_builtin NAME_builtin = {
+           SHELL_BUILTIN_ABI_VERSION, "NAME", NAME_accepts, NAME_run
+       };
+
+   and is built with e.g. `cc -shared -fPIC -o NAME.so NAME.c`. Once
+   enabled, the shell calls it in place of the external command NAME,
+   without forking. The bundled cat, head, wc, true, false and test use
+   the same interface.
+
+   accepts() looks only at the arguments (and may stat files) and must
+   not do any I/O; it returns SHELL_BUILTIN_DECLINE for invocations the
+   builtin doesn't handle (unsupported options, unusual operands), and
+   the external command runs instead. A NULL accepts takes everything
+   and is assumed to read stdin.
+
+   run() does the work with stdin, stdout and stderr on in_fd, out_fd
+   and err_fd, and returns the exit status. It runs inside the shell,
+   possibly on a thread next to other pipeline stages, so it must not
+   exit, change the working directory, environment or signal handling,
+   keep state between calls, or close descriptors it didn't open. */
+#ifndef SHELL_BUILTIN_H
+#define SHELL_BUILTIN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHELL_BUILTIN_ABI_VERSION 1
+
+/* accepts() results */
+#define SHELL_BUILTIN_DECLINE 0			/* run the external command instead */
+#define SHELL_BUILTIN_ACCEPT 1			/* handled; doesn't read stdin */
+#define SHELL_BUILTIN_ACCEPT_STDIN 2	/* handled; reads stdin */
+
+struct shell_builtin {
+    int abi_version;		/* SHELL_BUILTIN_ABI_VERSION */
+    const char* name;
+    int (*accepts)(int argc, char* const argv[]);
+    int (*run)(int argc, char* const argv[], int in_fd, int out_fd, int err_fd);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
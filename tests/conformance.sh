@@ -0,0 +1,244 @@
+#!/usr/bin/env bash
+# ------------------------------------------------------------
+# Differential conformance and latency harness
+# ------------------------------------------------------------
+# Runs every case of tests/corpus.txt, plus generated quoting and escape
+# cases, through both the shell and bash (`-c`), and compares stdout,
+# stderr and exit status. Each case also has a latency budget: the
+# fastest of LATENCY_RUNS runs of the shell must finish within
+# LATENCY_BUDGET_MS. Exits 1 if any case differs or is over budget.
+#
+#   tests/conformance.sh [SHELL] [CORPUS]        (make test)
+#
+# Environment:
+#   BASH_BIN            reference shell (default: bash on PATH)
+#   FUZZ_CASES          number of generated cases (default: 200)
+#   FUZZ_SEED           seed of the generator (default: 1; same seed, same cases)
+#   LATENCY_BUDGET_MS   per-case budget in milliseconds (default: 50)
+#   LATENCY_RUNS        timed runs per case, the fastest counts (default: 3)
+#   RESULTS             also write one line per case to this file:
+#                       id <TAB> result <TAB> shell_ms <TAB> bash_ms <TAB> case
+#   VERBOSE=1           print every case, not only failures
+#
+# Corpus format: one command line per line; a line starting with "> "
+# continues the case above it on a new line (here-documents). Blank
+# lines and lines starting with "#" are skipped. A case starting with
+# "xfail " is a known difference: it is reported but doesn't fail the
+# run (and shows up as XPASS once it matches). A few shell-only checks
+# (session recording) run last, against fixed expected output.
+
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+shell_bin=${1:-$here/../shell}
+corpus=${2:-$here/corpus.txt}
+bash_bin=${BASH_BIN:-$(command -v bash)}
+fuzz_cases=${FUZZ_CASES:-200}
+fuzz_seed=${FUZZ_SEED:-1}
+budget_ms=${LATENCY_BUDGET_MS:-50}
+runs=${LATENCY_RUNS:-3}
+results=${RESULTS:-}
+verbose=${VERBOSE:-0}
+
+case $shell_bin in /*) ;; *) shell_bin=$PWD/$shell_bin ;; esac
+if [ ! -x "$shell_bin" ]; then
+    echo "conformance: $shell_bin: not an executable (run make first)" >&2
+    exit 2
+fi
+if [ ! -r "$corpus" ]; then
+    echo "conformance: $corpus: cannot read corpus" >&2
+    exit 2
+fi
+[ -n "$results" ] && : > "$results"
+
+# ---------- scratch directory with fixture files ----------
+work=$(mktemp -d "${TMPDIR:-/tmp}/conformance.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+fixtures=$work/fixtures
+mkdir -p "$fixtures/sub/deep" "$fixtures/empty"
+printf 'alpha\nbeta\ngamma\n' > "$fixtures/a.txt"
+printf 'one two  three\n\nfour\n' > "$fixtures/b.txt"
+printf 'no newline at end' > "$fixtures/c.log"
+seq 1 1000 > "$fixtures/numbers"
+printf 'x\n' > "$fixtures/sub/x.txt"
+printf 'y\n' > "$fixtures/sub/deep/y.txt"
+printf 'spaced\n' > "$fixtures/with space.txt"
+
+# Helper: Milliseconds since the epoch (bash 5 has EPOCHREALTIME; older ones use date)
+now_us(){
+    if [ -n "${EPOCHREALTIME:-}" ]; then
+        local t=${EPOCHREALTIME/[.,]/}
+        echo "$t"
+    else
+        echo $(( $(date +%s%N) / 1000 ))
+    fi
+}
+
+# Helper: Runs one case under a shell in a fresh copy of the fixtures
+# (out/err/status files in $2.*); echoes the elapsed microseconds
+run_case(){
+    local bin=$1 prefix=$2 text=$3
+    rm -rf "$work/run" && cp -R "$fixtures" "$work/run"
+    local start end
+    start=$(now_us)
+    (cd "$work/run" && exec env -i PATH="$PATH" HOME="$work/run" LC_ALL=C TERM=dumb \
+        timeout 10 "$bin" -c "$text" > "$prefix.out" 2> "$prefix.err" < /dev/null)
+    echo $? > "$prefix.status"
+    end=$(now_us)
+    echo $(( end - start ))
+}
+
+# Helper: Error messages without the shell's own prefix ("bash: -c: line 1: ", "/path/shell: ")
+normalize_err(){
+    sed -E -e 's/^([^:]*\/)?(bash|shell)(: -c)?: (line [0-9]+: )?//' "$1"
+}
+
+# Helper: Latency of a case under the shell: the fastest of $runs runs
+best_latency(){
+    local text=$1 best=-1 t i
+    for (( i=0; i<runs; i++ )); do
+        t=$(run_case "$shell_bin" "$work/timing" "$text")
+        if (( best < 0 || t < best )); then best=$t; fi
+    done
+    echo "$best"
+}
+
+total=0 passed=0 failed=0 slow=0 xfailed=0 xpassed=0
+sum_shell_us=0 sum_bash_us=0
+
+# Runs one case and records its result
+check_case(){
+    local id=$1 text=$2 expect_fail=0
+    if [[ $text == "xfail "* ]]; then
+        expect_fail=1
+        text=${text#xfail }
+    fi
+    total=$((total+1))
+
+    local bash_us shell_us
+    bash_us=$(run_case "$bash_bin" "$work/bash" "$text")
+    run_case "$shell_bin" "$work/shell" "$text" > /dev/null
+    shell_us=$(best_latency "$text")
+    sum_shell_us=$((sum_shell_us + shell_us))
+    sum_bash_us=$((sum_bash_us + bash_us))
+
+    local what=""
+    cmp -s "$work/shell.out" "$work/bash.out" || what+=" stdout"
+    cmp -s <(normalize_err "$work/shell.err") <(normalize_err "$work/bash.err") || what+=" stderr"
+    cmp -s "$work/shell.status" "$work/bash.status" || what+=" status"
+
+    local result
+    if [ -n "$what" ]; then
+        if (( expect_fail )); then result=XFAIL; xfailed=$((xfailed+1)); else result=FAIL; failed=$((failed+1)); fi
+    elif (( shell_us > budget_ms*1000 )); then
+        result=SLOW; slow=$((slow+1))
+    elif (( expect_fail )); then
+        result=XPASS; xpassed=$((xpassed+1))
+    else
+        result=ok; passed=$((passed+1))
+    fi
+
+    local shell_ms bash_ms
+    shell_ms=$(printf '%d.%03d' $((shell_us/1000)) $((shell_us%1000)))
+    bash_ms=$(printf '%d.%03d' $((bash_us/1000)) $((bash_us%1000)))
+    [ -n "$results" ] && printf '%s\t%s\t%s\t%s\t%s\n' "$id" "$result" "$shell_ms" "$bash_ms" "${text//$'\n'/\\n}" >> "$results"
+
+    if [ "$result" = FAIL ] || [ "$result" = SLOW ] || [ "$result" = XPASS ] || [ "$verbose" = 1 ]; then
+        printf '%-5s %s (%s ms, bash %s ms)%s\n' "$result" "$id" "$shell_ms" "$bash_ms" "${what:+ -$what differ}"
+        printf '      %s\n' "${text//$'\n'/$'\n'      }"
+        if [ "$result" = FAIL ]; then
+            diff <(printf 'status %s\n' "$(cat "$work/shell.status")"; cat "$work/shell.out"; normalize_err "$work/shell.err" | sed 's/^/err: /') \
+                 <(printf 'status %s\n' "$(cat "$work/bash.status")"; cat "$work/bash.out"; normalize_err "$work/bash.err" | sed 's/^/err: /') \
+                 | sed -n 's/^\([<>]\)/      \1/p' | head -20
+        fi
+    fi
+}
+
+# ---------- corpus ----------
+pending="" pending_line=0 line_no=0
+while IFS= read -r line || [ -n "$line" ]; do
+    line_no=$((line_no+1))
+    if [[ $line == ">"* && -n $pending ]]; then
+        rest=${line#>}
+        pending+=$'\n'"${rest# }"
+        continue
+    fi
+    [ -n "$pending" ] && check_case "corpus:$pending_line" "$pending"
+    pending=""
+    [[ -z $line || $line == "#"* ]] && continue
+    pending=$line
+    pending_line=$line_no
+done < "$corpus"
+[ -n "$pending" ] && check_case "corpus:$pending_line" "$pending"
+
+# ---------- generated quoting and escape cases ----------
+# Words are glued together from pieces that exercise the lexer: quotes
+# of both kinds, backslashes inside and outside quotes, parameter
+# expansions (quoted, unquoted, braced) and glob characters. printf
+# shows exactly how each command line was split into arguments.
+pieces=(
+    'a' 'b c' "'x y'" '"p q"' "''" '""' '\ ' '\\' '\"' "\\'" '"\""' '"\\"' '"\$"'
+    "'\\'" '"a\b"' '$V' '"$V"' '${V}z' '"${V}"' '$E' '"$E"' '\$V' "'\$V'" '$?'
+    '*.txt' '"*.txt"' 's?b' '[ab].txt' '\*' '"~"' '#' 'a#b' '%' '-n' '='
+)
+RANDOM=$fuzz_seed
+for (( n=1; n<=fuzz_cases; n++ )); do
+    words=$(( RANDOM % 4 + 1 ))
+    text="V='1  2'; E=; printf '<%s>\\n'"
+    for (( w=0; w<words; w++ )); do
+        word=""
+        parts=$(( RANDOM % 3 + 1 ))
+        for (( p=0; p<parts; p++ )); do
+            word+=${pieces[RANDOM % ${#pieces[@]}]}
+        done
+        text+=" $word"
+    done
+    check_case "fuzz:$n" "$text"
+done
+
+# ---------- session recording ----------
+# Shell-only checks (bash has no counterpart): a recorded session must
+# behave like an unrecorded one, and shell --cast must give back what
+# was recorded. Each check's output is compared with the expected text.
+check_shell(){
+    local id=$1 text=$2 expected=$3 actual
+    total=$((total+1))
+    actual=$(cd "$work" && SHELL_BIN=$shell_bin bash -c "$text" 2>&1)
+    if [ "$actual" = "$expected" ]; then
+        passed=$((passed+1))
+        [ "$verbose" = 1 ] && printf 'ok    %s\n      %s\n' "$id" "$text"
+    else
+        failed=$((failed+1))
+        printf 'FAIL  %s\n      %s\n' "$id" "$text"
+        diff <(printf '%s\n' "$actual") <(printf '%s\n' "$expected") | sed -n 's/^\([<>]\)/      \1/p' | head -20
+    fi
+    [ -n "$results" ] && printf '%s\t%s\t\t\t%s\n' "$id" "$([ "$actual" = "$expected" ] && echo ok || echo FAIL)" "$text" >> "$results"
+    rm -f "$work"/*.rec
+}
+
+check_shell record:status 'SHELL_RECORD=s.rec "$SHELL_BIN" -c "echo out; exit 3"; echo $?' $'out\n3'
+check_shell record:closed-reader 'SHELL_RECORD=p.rec timeout 10 "$SHELL_BIN" -c yes | head -n 1; echo "${PIPESTATUS[0]}"' $'y\n141'
+check_shell record:cast 'SHELL_RECORD=c.rec "$SHELL_BIN" -c "echo recorded" > /dev/null; "$SHELL_BIN" --cast c.rec | sed -e "1s/.*\"version\": 2,.*/header/" -e "2s/^\[[0-9.]*, /[/"' \
+    $'header\n["o", "recorded\\u000a"]'
+check_shell record:cast-sessions 'for s in one two; do SHELL_RECORD=m.rec "$SHELL_BIN" -c "echo $s" > /dev/null; done; "$SHELL_BIN" --cast m.rec 1 | grep -c one; "$SHELL_BIN" --cast m.rec | grep -c two' $'1\n1'
+check_shell record:cast-bad-number 'SHELL_RECORD=n.rec "$SHELL_BIN" -c "echo x" > /dev/null; "$SHELL_BIN" --cast n.rec abc 2>&1 | sed "s/^[^:]*: //"; echo "${PIPESTATUS[0]}"' $'--cast: abc: session number expected (1 is the first)\n2'
+
+# ---------- reserved input bytes ----------
+# The lexer marks expansions with control bytes \x01-\x08; typed ones are refused, not misread.
+check_shell input:control-byte 'printf "echo a\\003b\\necho ok\\n" | "$SHELL_BIN"; echo $?' $'syntax error: control character \\x03 in input\nok\n0'
+
+# ---------- subshell scope ----------
+# $(...) and pipeline stages run in subshells: a setting changed there stays there.
+check_shell subst:set-scope '"$SHELL_BIN" -c "x=\$(set +o zerocopy); set -o | grep zerocopy"' 'zerocopy        on'
+check_shell pipe:set-scope '"$SHELL_BIN" -c "set +o zerocopy | cat; echo | set +o posixspawn; set -o"' $'posixspawn      on\nzerocopy        on'
+
+# ---------- fork spawn path ----------
+# SHELL_SPAWN=fork execs in the child: a script without #! still runs through /bin/sh.
+check_shell fork:no-shebang 'printf "echo script \$1\n" > ns.sh; chmod +x ns.sh; SHELL_SPAWN=fork "$SHELL_BIN" -c "./ns.sh a; echo \$?"; rm ns.sh' $'script a\n0'
+
+# ---------- summary ----------
+printf '\n%d cases: %d ok, %d failed, %d over the %d ms budget, %d known differences' \
+    "$total" "$passed" "$failed" "$slow" "$budget_ms" "$xfailed"
+(( xpassed )) && printf ', %d unexpectedly passing' "$xpassed"
+printf '\ntotal latency: shell %d ms, bash %d ms\n' $((sum_shell_us/1000)) $((sum_bash_us/1000))
+(( failed == 0 && slow == 0 ))